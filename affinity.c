@@ -0,0 +1,40 @@
+#ifdef __linux__
+  #define _GNU_SOURCE
+  #include <sched.h>
+#endif
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+#include "affinity.h"
+#include "utils.h"
+
+// pin each OpenMP thread to its own CPU, spread evenly over the CPUs we may run on
+// memory is placed on the NUMA node of the thread that first touches it,
+// so the buffers of each file stay local to the thread decoding it
+void bind_threads(void) {
+#if defined(__linux__) && defined(_OPENMP)
+        cpu_set_t allowed;
+        if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) { die_perror("could not get CPU affinity"); }
+        unsigned ncpu = CPU_COUNT(&allowed);
+        unsigned cpus[CPU_SETSIZE];
+        for(unsigned i = 0, n = 0; i < CPU_SETSIZE && n < ncpu; i++) {
+                if(CPU_ISSET(i, &allowed)) {
+                        cpus[n++] = i;
+                }
+        }
+        OPENMP(parallel)
+        {
+                unsigned nthread = omp_get_num_threads();
+                unsigned thread = omp_get_thread_num();
+                // with more threads than CPUs, threads share CPUs round robin
+                unsigned cpu = nthread <= ncpu ? cpus[(unsigned long long)thread * ncpu / nthread] : cpus[thread % ncpu];
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                if(sched_setaffinity(0, sizeof(set), &set) != 0) { die_perror("could not bind thread to CPU %u", cpu); }
+        }
+#else
+        die("binding threads to CPUs is not supported by this version");
+#endif
+}
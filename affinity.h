@@ -0,0 +1,6 @@
+#ifndef JPEG2PNG_AFFINITY_H
+#define JPEG2PNG_AFFINITY_H
+
+void bind_threads(void);
+
+#endif
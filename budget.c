@@ -0,0 +1,80 @@
+#include "budget.h"
+#include "utils.h"
+
+// iterations after which the result is within a mean difference of about 0.45 (of 255) from 400 iterations,
+// by the mean quantization step of a table
+// measured on photos recompressed at the IJG qualities in the comments, the size of the picture made no difference
+struct calibration {
+        float quant;
+        unsigned iterations;
+};
+
+// luma, and all components optimized together
+static const struct calibration luma_calibration[] = {
+        {6., 30},   // 95
+        {17., 45},  // 85
+        {35., 70},  // 70
+        {58., 105}, // 50
+        {96., 165}, // 30
+        {142., 250}, // 20
+        {196., 350}, // 10
+};
+
+// chroma optimized separately, measured with luma fixed at 400 iterations on 4:2:0 photos
+// it converges slower than luma with the same quantization
+static const struct calibration chroma_calibration[] = {
+        {9., 60},    // 95
+        {26., 105},  // 85
+        {51., 150},  // 70
+        {86., 185},  // 50
+        {143., 215}, // 30
+        {236., 330}, // 10
+};
+
+// iterations needed for a component with this quantization, interpolated from the calibration
+static unsigned iteration_budget(const struct coef *coef, unsigned n, const struct calibration calibration[n]) {
+        float quant = 0.;
+        for(unsigned j = 0; j < 64; j++) {
+                quant += coef->quant_table[j];
+        }
+        quant /= 64;
+        if(quant <= calibration[0].quant) {
+                return calibration[0].iterations;
+        }
+        for(unsigned i = 1; i < n; i++) {
+                if(quant <= calibration[i].quant) {
+                        float f = (quant - calibration[i-1].quant) / (calibration[i].quant - calibration[i-1].quant);
+                        return calibration[i-1].iterations + f * (calibration[i].iterations - calibration[i-1].iterations) + 0.5;
+                }
+        }
+        return calibration[n-1].iterations;
+}
+
+// iterations for each component, instead of those given by -i
+// components optimized together get the budget of the first
+void auto_iterations(const struct jpeg *jpeg, bool all_together, unsigned iterations[MAX_NCOMPONENT]) {
+        unsigned nluma = sizeof(luma_calibration) / sizeof(*luma_calibration);
+        unsigned nchroma = sizeof(chroma_calibration) / sizeof(*chroma_calibration);
+        for(unsigned c = 0; c < MAX_NCOMPONENT; c++) {
+                unsigned from = all_together || c >= jpeg->ncomponent ? 0 : c;
+                bool chroma = (jpeg->color == COLOR_YCBCR || jpeg->color == COLOR_YCCK) && (from == 1 || from == 2);
+                if(chroma) {
+                        iterations[c] = iteration_budget(&jpeg->coefs[from], nchroma, chroma_calibration);
+                } else {
+                        iterations[c] = iteration_budget(&jpeg->coefs[from], nluma, luma_calibration);
+                }
+        }
+}
+
+// whether the feasible set of the component is finer than the output precision, so optimizing it changes nothing visible
+// a uniform error in [-q/2, q/2] has a root mean square of q/sqrt(12), and the DCT keeps it in the pixels
+// this is compared to half a level of a PNG with the given bits, in the units of 8 bits
+bool trivial_quantization(const struct coef *coef, unsigned bits) {
+        float sq_quant = 0.;
+        for(unsigned j = 0; j < 64; j++) {
+                sq_quant += sqr(coef->quant_table[j]);
+        }
+        sq_quant /= 64;
+        float level = 256. / (1 << bits);
+        return sq_quant / 12 < sqr(0.5 * level);
+}
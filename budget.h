@@ -0,0 +1,11 @@
+#ifndef JPEG2PNG_BUDGET_H
+#define JPEG2PNG_BUDGET_H
+
+#include <stdbool.h>
+
+#include "jpeg.h"
+
+void auto_iterations(const struct jpeg *jpeg, bool all_together, unsigned iterations[MAX_NCOMPONENT]);
+bool trivial_quantization(const struct coef *coef, unsigned bits);
+
+#endif
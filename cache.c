@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "output.h"
+#include "utils.h"
+
+// on-disk cache of output files, named by the hash of everything that determines them
+
+// file name in the cache for a hash
+char *cache_filename(const char *cache_dir, const unsigned char digest[32]) {
+        size_t l = strlen(cache_dir) + 1 + 64 + 4 + 1;
+        char *name = malloc(l);
+        if(!name) { die("could not allocate cache file name"); }
+        int n = snprintf(name, l, "%s/", cache_dir);
+        for(unsigned i = 0; i < 32; i++) {
+                n += snprintf(name + n, l - n, "%02x", digest[i]);
+        }
+        snprintf(name + n, l - n, ".png");
+        return name;
+}
+
+// copy an opened file to a new output file
+static void copy_file(FILE *in, const char *infile, const char *outfile) {
+        struct output output;
+        FILE *out = output_open(outfile, &output);
+        char buffer[1 << 16];
+        size_t n;
+        while((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+                if(fwrite(buffer, 1, n, out) != n) {
+                        break;
+                }
+        }
+        if(ferror(in)) { die_perror("could not read `%s`", infile); }
+        output_close(&output);
+}
+
+// copy the cached output file, if there is one
+bool cache_fetch(const char *cache_file, const char *outfile) {
+        FILE *in = fopen(cache_file, "rb");
+        if(!in) {
+                return false;
+        }
+        copy_file(in, cache_file, outfile);
+        fclose(in);
+        return true;
+}
@@ -0,0 +1,9 @@
+#ifndef JPEG2PNG_CACHE_H
+#define JPEG2PNG_CACHE_H
+
+#include <stdbool.h>
+
+char *cache_filename(const char *cache_dir, const unsigned char digest[32]);
+bool cache_fetch(const char *cache_file, const char *outfile);
+
+#endif
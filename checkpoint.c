@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "checkpoint.h"
+#include "output.h"
+#include "utils.h"
+
+// file format, in native byte order:
+// magic, key, uint32_t nplane, uint64_t size of each plane in bytes, uint32_t iteration, float t, planes
+static const char checkpoint_magic[16] = "jpeg2png ckpt 1\n";
+
+static bool read_all(FILE *f, void *data, size_t n) {
+        return fread(data, 1, n, f) == n;
+}
+
+// write the state, atomically replacing an older checkpoint
+void checkpoint_save(struct checkpoint *checkpoint, unsigned iteration, float t, unsigned nplane, void *planes[nplane], size_t sizes[nplane]) {
+        struct output output;
+        FILE *f = output_open(checkpoint->filename, &output);
+        fwrite(checkpoint_magic, 1, sizeof(checkpoint_magic), f);
+        fwrite(checkpoint->key, 1, sizeof(checkpoint->key), f);
+        uint32_t n = nplane;
+        fwrite(&n, 1, sizeof(n), f);
+        for(unsigned i = 0; i < nplane; i++) {
+                uint64_t size = sizes[i];
+                fwrite(&size, 1, sizeof(size), f);
+        }
+        uint32_t it = iteration;
+        fwrite(&it, 1, sizeof(it), f);
+        fwrite(&t, 1, sizeof(t), f);
+        for(unsigned i = 0; i < nplane; i++) {
+                fwrite(planes[i], 1, sizes[i], f);
+        }
+        // write errors are reported by output_close
+        output_close(&output);
+}
+
+// read the state if there is a checkpoint for the same key and plane sizes
+// the planes are only changed when it is used
+bool checkpoint_load(struct checkpoint *checkpoint, unsigned *iteration, float *t, unsigned nplane, void *planes[nplane], size_t sizes[nplane]) {
+        FILE *f = fopen(checkpoint->filename, "rb");
+        if(!f) {
+                if(errno != ENOENT) { die_perror("could not open checkpoint `%s`", checkpoint->filename); }
+                return false;
+        }
+        bool ok = true;
+        char magic[sizeof(checkpoint_magic)];
+        unsigned char key[sizeof(checkpoint->key)];
+        uint32_t n;
+        ok = ok && read_all(f, magic, sizeof(magic)) && memcmp(magic, checkpoint_magic, sizeof(magic)) == 0;
+        ok = ok && read_all(f, key, sizeof(key)) && memcmp(key, checkpoint->key, sizeof(key)) == 0;
+        ok = ok && read_all(f, &n, sizeof(n)) && n == nplane;
+        for(unsigned i = 0; ok && i < nplane; i++) {
+                uint64_t size;
+                ok = read_all(f, &size, sizeof(size)) && size == sizes[i];
+        }
+        uint32_t it;
+        float tt;
+        ok = ok && read_all(f, &it, sizeof(it)) && read_all(f, &tt, sizeof(tt));
+        if(!ok) {
+                fprintf(stderr, "warning: ignoring checkpoint `%s` of a different input or options\n", checkpoint->filename);
+                fclose(f);
+                return false;
+        }
+        for(unsigned i = 0; i < nplane; i++) {
+                if(!read_all(f, planes[i], sizes[i])) { die("checkpoint `%s` is truncated", checkpoint->filename); }
+        }
+        fclose(f);
+        *iteration = it;
+        *t = tt;
+        return true;
+}
+
+// remove the checkpoint once the result is written
+void checkpoint_remove(struct checkpoint *checkpoint) {
+        if(remove(checkpoint->filename) != 0 && errno != ENOENT) {
+                die_perror("could not remove checkpoint `%s`", checkpoint->filename);
+        }
+}
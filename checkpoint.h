@@ -0,0 +1,22 @@
+#ifndef JPEG2PNG_CHECKPOINT_H
+#define JPEG2PNG_CHECKPOINT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// saved state of a compute() run, so it can be resumed after being interrupted
+struct checkpoint {
+        char *filename;
+        // save every interval iterations, 0 for never
+        unsigned interval;
+        // continue from the checkpoint file if it matches
+        bool resume;
+        // hash of the input and options, a checkpoint is only used with the same key
+        unsigned char key[32];
+};
+
+void checkpoint_save(struct checkpoint *checkpoint, unsigned iteration, float t, unsigned nplane, void *planes[nplane], size_t sizes[nplane]);
+bool checkpoint_load(struct checkpoint *checkpoint, unsigned *iteration, float *t, unsigned nplane, void *planes[nplane], size_t sizes[nplane]);
+void checkpoint_remove(struct checkpoint *checkpoint);
+
+#endif
@@ -3,12 +3,14 @@
 #include <math.h>
 #include <assert.h>
 #include <float.h>
+#include <stdalign.h>
 
 #include "jpeg2png.h"
 #include "compute.h"
 #include "utils.h"
 #include "box.h"
 #include "logger.h"
+#include "half.h"
 
 #include "ooura/dct.h"
 
@@ -19,8 +21,17 @@ static_assert(FLT_EVAL_METHOD == 0, "to preserve identical output please disable
 
 // working buffers for each component
 struct aux {
+        // size of the image planes
+        unsigned w;
+        unsigned h;
         // DCT coefficients for step_prob
-        float *cos;
+        cold_float *cos;
+        // dequantized DCT coefficients, the centers of the feasible intervals
+        float *dequant;
+        // for each coefficient of a block, the quantization step, half of it and its square
+        alignas(16) float quant[64];
+        alignas(16) float half_quant[64];
+        alignas(16) float sq_quant[64];
         // gradient (derivative) of the objective function
         float *obj_gradient;
         // temp[0] = pixel differences in x direction
@@ -30,23 +41,85 @@ struct aux {
         // image data
         float *fdata;
         // previous step image data for FISTA
-        float *fista;
+        cold_float *fista;
 };
 
+// luma downsampled to the resolution of native resolution chroma
+// it is optimized together with the chroma to couple the edges of all channels
+struct coupling {
+        struct aux aux;
+        // size of a chroma sample in luma pixels
+        unsigned w_samp;
+        unsigned h_samp;
+};
+
+// run statement with NCHANNEL a constant for the common numbers of channels, 1 and 3, and the variable otherwise
+// with the kernels inlined, the compiler can then unroll the loops over channels
+#define SPECIALIZE_NCHANNEL(nchannel, statement) do { \
+        if((nchannel) == 1) { \
+                enum { NCHANNEL = 1 }; \
+                statement; \
+        } else if((nchannel) == 3) { \
+                enum { NCHANNEL = 3 }; \
+                statement; \
+        } else { \
+                unsigned NCHANNEL = (nchannel); \
+                statement; \
+        } \
+} while(0)
+
+// the same for the subsampling factors of the JPEG standard, as W_SAMP and H_SAMP
+#define SPECIALIZE_SAMP(w_samp, h_samp, statement) do { \
+        if((w_samp) == 1 && (h_samp) == 1) { \
+                enum { W_SAMP = 1, H_SAMP = 1 }; \
+                statement; \
+        } else if((w_samp) == 2 && (h_samp) == 1) { \
+                enum { W_SAMP = 2, H_SAMP = 1 }; \
+                statement; \
+        } else if((w_samp) == 1 && (h_samp) == 2) { \
+                enum { W_SAMP = 1, H_SAMP = 2 }; \
+                statement; \
+        } else if((w_samp) == 2 && (h_samp) == 2) { \
+                enum { W_SAMP = 2, H_SAMP = 2 }; \
+                statement; \
+        } else { \
+                unsigned W_SAMP = (w_samp), H_SAMP = (h_samp); \
+                statement; \
+        } \
+} while(0)
+
+// run statement with OBJECTIVE a constant for whether the kernels also compute the objective function
+// it is only needed for logging and adaptive steps, without it the kernels save the reductions
+#define SPECIALIZE_OBJECTIVE(objective, statement) do { \
+        if(objective) { \
+                enum { OBJECTIVE = true }; \
+                statement; \
+        } else { \
+                enum { OBJECTIVE = false }; \
+                statement; \
+        } \
+} while(0)
+
 // compute objective gradient for the distance of DCT coefficients from normal decoding
+// this initializes the objective gradient where the coefficients are, instead of adding to it
 // N.B. destroys cos
-POSSIBLY_UNUSED static double compute_step_prob_c(unsigned w, unsigned h, float alpha, struct coef *coef, float *cos, float *obj_gradient) {
+static ALWAYS_INLINE double compute_step_prob_c_samp(unsigned w, unsigned h, float alpha, struct coef *coef, struct aux *aux, bool objective, unsigned w_samp, unsigned h_samp) {
+        cold_float *cos = aux->cos;
+        float *obj_gradient = aux->obj_gradient;
         double prob_dist = 0.;
         unsigned block_w = coef->w / 8;
         unsigned block_h = coef->h / 8;
         for(unsigned block_y = 0; block_y < block_h; block_y++) {
                 for(unsigned block_x = 0; block_x < block_w; block_x++) {
                         unsigned i = block_y * block_w + block_x;
-                        float *cosb = &cos[i*64];
+                        alignas(16) float buf[64];
+                        float *cosb = real_block(&cos[i*64], buf);
                         for(unsigned j = 0; j < 64; j++) {
-                                cosb[j] -= (float)coef->data[i*64+j] * coef->quant_table[j];
-                                prob_dist += 0.5 * sqr(cosb[j] / coef->quant_table[j]); // objective function
-                                cosb[j] = cosb[j] / sqr((float)coef->quant_table[j]); // derivative
+                                cosb[j] -= aux->dequant[i*64+j];
+                                if(objective) {
+                                        prob_dist += 0.5 * sqr(cosb[j] / aux->quant[j]); // objective function
+                                }
+                                cosb[j] = cosb[j] / aux->sq_quant[j]; // derivative
                         }
                         idct8x8s(cosb);
                         // unbox and possibly upsample derivative
@@ -55,11 +128,11 @@ POSSIBLY_UNUSED static double compute_step_prob_c(unsigned w, unsigned h, float
                                         unsigned j = in_y * 8 + in_x;
                                         unsigned cx = block_x * 8 + in_x;
                                         unsigned cy = block_y * 8 + in_y;
-                                        for(unsigned sy = 0; sy < coef->h_samp; sy++) {
-                                                for(unsigned sx = 0; sx < coef->w_samp; sx++) {
-                                                        unsigned y = cy * coef->h_samp + sy;
-                                                        unsigned x = cx * coef->w_samp + sx;
-                                                        *p(obj_gradient, x, y, w, h) += alpha * cosb[j];
+                                        for(unsigned sy = 0; sy < h_samp; sy++) {
+                                                for(unsigned sx = 0; sx < w_samp; sx++) {
+                                                        unsigned y = cy * h_samp + sy;
+                                                        unsigned x = cx * w_samp + sx;
+                                                        *p(obj_gradient, x, y, w, h) = alpha * cosb[j];
                                                 }
                                         }
                                 }
@@ -69,10 +142,16 @@ POSSIBLY_UNUSED static double compute_step_prob_c(unsigned w, unsigned h, float
         return alpha * prob_dist;
 }
 
+// specialized for the JPEG subsampling factors 4:4:4, 4:2:2, 4:4:0 and 4:2:0
+POSSIBLY_UNUSED static double compute_step_prob_c(unsigned w, unsigned h, float alpha, struct coef *coef, struct aux *aux, bool objective) {
+        SPECIALIZE_OBJECTIVE(objective, SPECIALIZE_SAMP(coef->w_samp, coef->h_samp, return compute_step_prob_c_samp(w, h, alpha, coef, aux, OBJECTIVE, W_SAMP, H_SAMP)));
+}
+
 // compute objective gradient for TV for one pixel
-static void compute_step_tv_inner_c(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], unsigned x, unsigned y, double *tv) {
-        float g_xs[3] = {0};
-        float g_ys[3] = {0};
+// when tv is given, also add to the objective function
+static ALWAYS_INLINE void compute_step_tv_inner_c(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], unsigned x, unsigned y, double *tv) {
+        float g_xs[MAX_NCOMPONENT] = {0};
+        float g_ys[MAX_NCOMPONENT] = {0};
         for(unsigned c = 0; c < nchannel; c++) {
                 struct aux *aux = &auxs[c];
                 // forward difference x
@@ -88,7 +167,9 @@ static void compute_step_tv_inner_c(unsigned w, unsigned h, unsigned nchannel, s
         }
         g_norm = sqrtf(g_norm);
         float alpha = 1./sqrtf(nchannel);
-        *tv += alpha * g_norm; // objective function
+        if(tv) {
+                *tv += alpha * g_norm; // objective function
+        }
         // compute derivatives (see notes)
         for(unsigned c = 0; c < nchannel; c++) {
                 float g_x = g_xs[c];
@@ -112,23 +193,45 @@ static void compute_step_tv_inner_c(unsigned w, unsigned h, unsigned nchannel, s
         }
 }
 
+// add the squares of row y of the objective gradients to the squared norms, when given
+static ALWAYS_INLINE void accumulate_norms(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], unsigned y, double *sq_norms) {
+        if(!sq_norms) {
+                return;
+        }
+        for(unsigned c = 0; c < nchannel; c++) {
+                float *row = p(auxs[c].obj_gradient, 0, y, w, h);
+                for(unsigned x = 0; x < w; x++) {
+                        sq_norms[c] += sqr(row[x]);
+                }
+        }
+}
+
 // compute objective gradient for TV
-static double compute_step_tv_c(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel]) {
+// when sq_norms is given, also compute the squared norms of the final objective gradients
+static ALWAYS_INLINE double compute_step_tv_c_n(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], double *sq_norms, bool objective) {
         double tv = 0.;
-        ASSUME(nchannel <= 3);
+        double *ptv = objective ? &tv : NULL;
+        ASSUME(nchannel <= MAX_NCOMPONENT);
         for(unsigned y = 0; y < h; y++) {
                 for(unsigned x = 0; x < w; x++) {
-                        compute_step_tv_inner_c(w, h, nchannel, auxs, x, y, &tv);
+                        compute_step_tv_inner_c(w, h, nchannel, auxs, x, y, ptv);
                 }
+                // no more changes to this row
+                accumulate_norms(w, h, nchannel, auxs, y, sq_norms);
         }
         return tv;
 }
 
+static double compute_step_tv_c(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], double *sq_norms, bool objective) {
+        SPECIALIZE_OBJECTIVE(objective, SPECIALIZE_NCHANNEL(nchannel, return compute_step_tv_c_n(w, h, NCHANNEL, auxs, sq_norms, OBJECTIVE)));
+}
+
 // compute objective gradient for second order TGV for one pixel
-static void compute_step_tv2_inner_c(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], float alpha, unsigned x, unsigned y, double *tv2) {
-        float g_xxs[3] = {0};
-        float g_xy_syms[3] = {0};
-        float g_yys[3] = {0};
+// when tv2 is given, also add to the objective function
+static ALWAYS_INLINE void compute_step_tv2_inner_c(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], float alpha, unsigned x, unsigned y, double *tv2) {
+        float g_xxs[MAX_NCOMPONENT] = {0};
+        float g_xy_syms[MAX_NCOMPONENT] = {0};
+        float g_yys[MAX_NCOMPONENT] = {0};
 
         for(unsigned c = 0; c < nchannel; c++) {
                 struct aux *aux = &auxs[c];
@@ -152,7 +255,9 @@ static void compute_step_tv2_inner_c(unsigned w, unsigned h, unsigned nchannel,
         g2_norm = sqrtf(g2_norm);
 
         alpha = alpha * 1./sqrtf(nchannel);
-        *tv2 += alpha * g2_norm; // objective function
+        if(tv2) {
+                *tv2 += alpha * g2_norm; // objective function
+        }
 
         // compute derivatives (see notes)
         if(g2_norm != 0.) {
@@ -186,18 +291,29 @@ static void compute_step_tv2_inner_c(unsigned w, unsigned h, unsigned nchannel,
 }
 
 // compute objective gradient for second order TGV
-static double compute_step_tv2_c(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], float alpha) {
+// when sq_norms is given, also compute the squared norms of the final objective gradients
+static ALWAYS_INLINE double compute_step_tv2_c_n(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], float alpha, double *sq_norms, bool objective) {
         double tv2 = 0.;
+        double *ptv2 = objective ? &tv2 : NULL;
         for(unsigned y = 0; y < h; y++) {
                 for(unsigned x = 0; x < w; x++) {
-                        compute_step_tv2_inner_c(w, h, nchannel, auxs, alpha, x, y, &tv2);
+                        compute_step_tv2_inner_c(w, h, nchannel, auxs, alpha, x, y, ptv2);
+                }
+                // no more changes to the previous row
+                if(y > 0) {
+                        accumulate_norms(w, h, nchannel, auxs, y-1, sq_norms);
                 }
         }
+        accumulate_norms(w, h, nchannel, auxs, h-1, sq_norms);
         return tv2;
 }
 
+static double compute_step_tv2_c(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], float alpha, double *sq_norms, bool objective) {
+        SPECIALIZE_OBJECTIVE(objective, SPECIALIZE_NCHANNEL(nchannel, return compute_step_tv2_c_n(w, h, NCHANNEL, auxs, alpha, sq_norms, OBJECTIVE)));
+}
+
 // compute Euclidean norm
-static double compute_norm(unsigned w, unsigned h, float *data) {
+static float compute_norm(unsigned w, unsigned h, float *data) {
         double norm = 0.;
         for(unsigned i = 0; i < h * w; i++) {
                 norm += sqr(data[i]);
@@ -205,91 +321,321 @@ static double compute_norm(unsigned w, unsigned h, float *data) {
         return sqrtf(norm);
 }
 
-// make step in the direction of the objective gradient with distance step_size
-static void compute_do_step(unsigned w, unsigned h, float *fdata, float *obj_gradient, float step_size) {
-        float norm = compute_norm(w, h, obj_gradient);
-        if(norm != 0.) {
-                for(unsigned i = 0; i < h * w; i++) {
-                        fdata[i] = fdata[i] - step_size * (obj_gradient[i] /  norm);
+// convert from normal order to 8x8 blocks, while making the step in the direction of the objective gradient with distance step_size
+POSSIBLY_UNUSED static void box_step_c(float *fdata, float *obj_gradient, float *boxed, unsigned w, unsigned h, float step_size, float norm) {
+        for(unsigned block_y = 0; block_y < h / 8; block_y++) {
+                for(unsigned block_x = 0; block_x < w / 8; block_x++) {
+                        for(unsigned in_y = 0; in_y < 8; in_y++) {
+                                for(unsigned in_x = 0; in_x < 8; in_x++) {
+                                        unsigned x = block_x * 8 + in_x;
+                                        unsigned y = block_y * 8 + in_y;
+                                        *boxed++ = *p(fdata, x, y, w, h) - step_size * (*p(obj_gradient, x, y, w, h) / norm);
+                                }
+                        }
+                }
+        }
+}
+
+// FISTA extrapolation from the current point x
+// stores the extrapolated point in fdata and x as previous point in fista
+static void fista_extrapolate(float *fdata, cold_float *fista, unsigned i, float x, float factor) {
+        fdata[i] = x + factor * (x - cold_get(fista, i));
+        cold_set(fista, i, x);
+}
+
+// convert from 8x8 blocks to normal order, while making the FISTA extrapolation for the next iteration
+POSSIBLY_UNUSED static void unbox_fista_c(float *boxed, float *fdata, cold_float *fista, unsigned w, unsigned h, float factor) {
+        for(unsigned block_y = 0; block_y < h / 8; block_y++) {
+                for(unsigned block_x = 0; block_x < w / 8; block_x++) {
+                        for(unsigned in_y = 0; in_y < 8; in_y++) {
+                                for(unsigned in_x = 0; in_x < 8; in_x++) {
+                                        unsigned x = block_x * 8 + in_x;
+                                        unsigned y = block_y * 8 + in_y;
+                                        check(x, y, w, h);
+                                        fista_extrapolate(fdata, fista, y * w + x, *boxed++, factor);
+                                }
+                        }
+                }
+        }
+}
+
+// make the step like box_step, then downsample to the resolution of the jpg in 8x8 blocks and keep the difference
+// more formally, decompose each subsampling block in the direction of our subsampling vector (a vector of ones)
+static ALWAYS_INLINE void downsample_box_step_c_samp(float *fdata, float *obj_gradient, float *boxed, unsigned w, unsigned h, struct coef *coef, float step_size, float norm, unsigned w_samp, unsigned h_samp) {
+        for(unsigned block_y = 0; block_y < coef->h / 8; block_y++) {
+                for(unsigned block_x = 0; block_x < coef->w / 8; block_x++) {
+                        for(unsigned in_y = 0; in_y < 8; in_y++) {
+                                for(unsigned in_x = 0; in_x < 8; in_x++) {
+                                        unsigned cx = block_x * 8 + in_x;
+                                        unsigned cy = block_y * 8 + in_y;
+                                        float mean = 0.;
+                                        for(unsigned sy = 0; sy < h_samp; sy++) {
+                                                for(unsigned sx = 0; sx < w_samp; sx++) {
+                                                        unsigned y = cy * h_samp + sy;
+                                                        unsigned x = cx * w_samp + sx;
+                                                        float *here = p(fdata, x, y, w, h);
+                                                        if(norm != 0.) {
+                                                                *here = *here - step_size * (*p(obj_gradient, x, y, w, h) / norm);
+                                                        }
+                                                        mean += *here;
+                                                }
+                                        }
+                                        mean /= w_samp * h_samp;
+                                        *boxed++ = mean;
+                                        for(unsigned sy = 0; sy < h_samp; sy++) {
+                                                for(unsigned sx = 0; sx < w_samp; sx++) {
+                                                        unsigned y = cy * h_samp + sy;
+                                                        unsigned x = cx * w_samp + sx;
+                                                        *p(fdata, x, y, w, h) -= mean;
+                                                }
+                                        }
+                                }
+                        }
+                }
+        }
+}
+
+POSSIBLY_UNUSED static void downsample_box_step_c(float *fdata, float *obj_gradient, float *boxed, unsigned w, unsigned h, struct coef *coef, float step_size, float norm) {
+        SPECIALIZE_SAMP(coef->w_samp, coef->h_samp, downsample_box_step_c_samp(fdata, obj_gradient, boxed, w, h, coef, step_size, norm, W_SAMP, H_SAMP));
+}
+
+// convert from 8x8 blocks at the resolution of the jpg and add back the difference (orthogonal to our subsampling vector)
+// when extrapolate is set, also make the FISTA extrapolation for the next iteration
+static ALWAYS_INLINE void upsample_unbox_fista_c_samp(float *boxed, float *fdata, cold_float *fista, unsigned w, unsigned h, struct coef *coef, bool extrapolate, float factor, unsigned w_samp, unsigned h_samp) {
+        for(unsigned block_y = 0; block_y < coef->h / 8; block_y++) {
+                for(unsigned block_x = 0; block_x < coef->w / 8; block_x++) {
+                        for(unsigned in_y = 0; in_y < 8; in_y++) {
+                                for(unsigned in_x = 0; in_x < 8; in_x++) {
+                                        unsigned cx = block_x * 8 + in_x;
+                                        unsigned cy = block_y * 8 + in_y;
+                                        float mean = *boxed++;
+                                        for(unsigned sy = 0; sy < h_samp; sy++) {
+                                                for(unsigned sx = 0; sx < w_samp; sx++) {
+                                                        unsigned y = cy * h_samp + sy;
+                                                        unsigned x = cx * w_samp + sx;
+                                                        float *here = p(fdata, x, y, w, h);
+                                                        if(extrapolate) {
+                                                                fista_extrapolate(fdata, fista, y * w + x, *here + mean, factor);
+                                                        } else {
+                                                                *here += mean;
+                                                        }
+                                                }
+                                        }
+                                }
+                        }
                 }
         }
 }
 
+POSSIBLY_UNUSED static void upsample_unbox_fista_c(float *boxed, float *fdata, cold_float *fista, unsigned w, unsigned h, struct coef *coef, bool extrapolate, float factor) {
+        SPECIALIZE_SAMP(coef->w_samp, coef->h_samp, upsample_unbox_fista_c_samp(boxed, fdata, fista, w, h, coef, extrapolate, factor, W_SAMP, H_SAMP));
+}
+
 #ifdef USE_SIMD
 #include "compute_simd_step.c"
 #endif
 
-// compute objective gradient and make step
+#if defined(USE_SIMD) && defined(DEBUG)
+// the SIMD kernel for the DCT coefficient distance, checked against the C kernel
+// both builds must compute the same objective, the adaptive steps of -a decide on it
+static double compute_step_prob_checked(unsigned w, unsigned h, float alpha, struct coef *coef, struct aux *aux, bool objective) {
+        size_t n = (size_t)coef->w * coef->h;
+        struct aux c_aux = *aux;
+        c_aux.cos = alloc_cold(n);
+        memcpy(c_aux.cos, aux->cos, n * sizeof(*aux->cos));
+        c_aux.obj_gradient = alloc_real(w * h);
+        double c_dist = compute_step_prob_c(w, h, alpha, coef, &c_aux, objective);
+        double dist = compute_step_prob_simd(w, h, alpha, coef, aux, objective);
+        if(dist != c_dist) {
+                die("DCT coefficient distance %.9e of the SIMD kernel differs from %.9e of the C kernel", dist, c_dist);
+        }
+        free_cold(c_aux.cos);
+        free_real(c_aux.obj_gradient);
+        return dist;
+}
+#endif
+
+// downsample luma into the coupling channel, the mean over each chroma sample
+static void coupling_downsample(struct aux *luma, struct coupling *coupling) {
+        struct aux *aux = &coupling->aux;
+        float scale = 1. / (coupling->w_samp * coupling->h_samp);
+        for(unsigned cy = 0; cy < aux->h; cy++) {
+                for(unsigned cx = 0; cx < aux->w; cx++) {
+                        float mean = 0.;
+                        for(unsigned sy = 0; sy < coupling->h_samp; sy++) {
+                                for(unsigned sx = 0; sx < coupling->w_samp; sx++) {
+                                        unsigned y = MIN(cy * coupling->h_samp + sy, luma->h-1);
+                                        unsigned x = MIN(cx * coupling->w_samp + sx, luma->w-1);
+                                        mean += *p(luma->fdata, x, y, luma->w, luma->h);
+                                }
+                        }
+                        *p(aux->fdata, cx, cy, aux->w, aux->h) = mean * scale;
+                        *p(aux->obj_gradient, cx, cy, aux->w, aux->h) = 0.;
+                }
+        }
+}
+
+// add the objective gradient of the coupling channel to the luma objective gradient
+static void coupling_upsample_gradient(struct coupling *coupling, struct aux *luma) {
+        struct aux *aux = &coupling->aux;
+        float scale = 1. / (coupling->w_samp * coupling->h_samp);
+        for(unsigned cy = 0; cy < aux->h; cy++) {
+                for(unsigned cx = 0; cx < aux->w; cx++) {
+                        float g = *p(aux->obj_gradient, cx, cy, aux->w, aux->h) * scale;
+                        for(unsigned sy = 0; sy < coupling->h_samp; sy++) {
+                                for(unsigned sx = 0; sx < coupling->w_samp; sx++) {
+                                        unsigned y = MIN(cy * coupling->h_samp + sy, luma->h-1);
+                                        unsigned x = MIN(cx * coupling->w_samp + sx, luma->w-1);
+                                        *p(luma->obj_gradient, x, y, luma->w, luma->h) += g;
+                                }
+                        }
+                }
+        }
+}
+
+// zero the objective gradient outside of the area written by step_prob
+static void zero_uncovered(unsigned w, unsigned h, struct coef *coef, float *obj_gradient) {
+        unsigned covered_w = MIN(coef->w * coef->w_samp, w);
+        unsigned covered_h = MIN(coef->h * coef->h_samp, h);
+        for(unsigned y = 0; y < h; y++) {
+                for(unsigned x = y < covered_h ? covered_w : 0; x < w; x++) {
+                        *p(obj_gradient, x, y, w, h) = 0.;
+                }
+        }
+}
+
+// compute objective gradient and its norm
+// the step itself is made in compute_projection
+// with coupling, channel 0 is full resolution luma and the others are native resolution chroma
 static double compute_step(
-        unsigned w, unsigned h,
         unsigned nchannel,
         struct coef coefs[nchannel], struct aux auxs[nchannel],
-        float step_size, float weight, float pweight[nchannel],
-        struct logger *log)
+        struct coupling *coupling,
+        float weight, const float pweight[nchannel],
+        float norms[nchannel],
+        struct logger *log, bool objective)
 {
-        float total_alpha = 0.;
-
-        double prob_dist = 0.;
-        OPENMP(parallel for schedule(dynamic) reduction(+:total_alpha) reduction(+:prob_dist))
+        // the terms of the channels are summed in channel order after the loop,
+        // an OpenMP reduction would make the objective depend on the number of threads
+        float p_alphas[nchannel];
+        double prob_dists[nchannel];
+        OPENMP(parallel for schedule(static, 1))
         for(unsigned c = 0; c < nchannel; c++) {
                 struct aux *aux = &auxs[c];
                 struct coef *coef = &coefs[c];
 
-                // initialize gradient
-                for(unsigned i = 0; i < h * w; i++) {
-                        aux->obj_gradient[i] = 0.;
-                }
-
-                // DCT coefficent distance
+                // DCT coefficent distance, which initializes the gradient
+                p_alphas[c] = 0.;
+                prob_dists[c] = 0.;
                 if(pweight[c] !=  0.) {
-                        float p_alpha = pweight[c] * 2 * 255 * sqrtf(2);
-                        total_alpha += p_alpha;
-                        prob_dist += POSSIBLY_SIMD(compute_step_prob)(w, h, p_alpha, coef, aux->cos, aux->obj_gradient);
+                        p_alphas[c] = pweight[c] * 2 * 255 * sqrtf(2);
+#if defined(USE_SIMD) && defined(DEBUG)
+                        prob_dists[c] = compute_step_prob_checked(aux->w, aux->h, p_alphas[c], coef, aux, objective);
+#else
+                        prob_dists[c] = POSSIBLY_SIMD(compute_step_prob)(aux->w, aux->h, p_alphas[c], coef, aux, objective);
+#endif
+                        zero_uncovered(aux->w, aux->h, coef, aux->obj_gradient);
+                } else {
+                        memset(aux->obj_gradient, 0, sizeof(float) * aux->w * aux->h);
                 }
         }
+        float total_alpha = 0.;
+        double prob_dist = 0.;
+        for(unsigned c = 0; c < nchannel; c++) {
+                total_alpha += p_alphas[c];
+                prob_dist += prob_dists[c];
+        }
+
+        // the last of TV and TGV also computes the norms of the gradients
+        double sq_norms[nchannel];
+        for(unsigned c = 0; c < nchannel; c++) {
+                sq_norms[c] = 0.;
+        }
+        double chroma_sq_norms[3] = {0.};
+        bool tgv = weight != 0.;
 
         // TV
         total_alpha += nchannel;
-        double tv = POSSIBLY_SIMD(compute_step_tv)(w, h, nchannel, auxs);
+        double tv;
+        struct aux chroma[3];
+        if(coupling) {
+                ASSUME(nchannel == 3);
+                coupling_downsample(&auxs[0], coupling);
+                chroma[0] = coupling->aux;
+                chroma[1] = auxs[1];
+                chroma[2] = auxs[2];
+                tv = POSSIBLY_SIMD(compute_step_tv)(auxs[0].w, auxs[0].h, 1, &auxs[0], NULL, objective);
+                tv += POSSIBLY_SIMD(compute_step_tv)(chroma[0].w, chroma[0].h, 3, chroma, tgv ? NULL : chroma_sq_norms, objective);
+        } else {
+                tv = POSSIBLY_SIMD(compute_step_tv)(auxs[0].w, auxs[0].h, nchannel, auxs, tgv ? NULL : sq_norms, objective);
+        }
 
         // TGV second order
         double tv2 = 0.;
-        if(weight != 0.) {
+        if(tgv) {
                 float alpha = weight / sqrtf(4 / 2);
                 total_alpha += alpha * nchannel;
-                tv2 = POSSIBLY_SIMD(compute_step_tv2)(w, h, nchannel, auxs, alpha);
+                if(coupling) {
+                        tv2 = POSSIBLY_SIMD(compute_step_tv2)(auxs[0].w, auxs[0].h, 1, &auxs[0], alpha, NULL, objective);
+                        tv2 += POSSIBLY_SIMD(compute_step_tv2)(chroma[0].w, chroma[0].h, 3, chroma, alpha, chroma_sq_norms, objective);
+                } else {
+                        tv2 = POSSIBLY_SIMD(compute_step_tv2)(auxs[0].w, auxs[0].h, nchannel, auxs, alpha, sq_norms, objective);
+                }
         }
 
-        // do step
-        OPENMP(parallel for schedule(dynamic))
-        for(unsigned c = 0; c < nchannel; c++) {
-                struct aux *aux = &auxs[c];
-                compute_do_step(w, h, aux->fdata, aux->obj_gradient, step_size);
+        if(coupling) {
+                // luma also gets the gradient of the coupling channel, so its norm is computed separately
+                coupling_upsample_gradient(coupling, &auxs[0]);
+                norms[0] = compute_norm(auxs[0].w, auxs[0].h, auxs[0].obj_gradient);
+                norms[1] = sqrtf(chroma_sq_norms[1]);
+                norms[2] = sqrtf(chroma_sq_norms[2]);
+        } else {
+                for(unsigned c = 0; c < nchannel; c++) {
+                        norms[c] = sqrtf(sq_norms[c]);
+                }
+        }
+
+        if(!objective) {
+                return 0.;
         }
 
         // log objective values
-        double objective = (tv + tv2 + prob_dist) / total_alpha;
-        logger_log(log, objective, prob_dist, tv, tv2);
+        double value = (tv + tv2 + prob_dist) / total_alpha;
+        logger_log(log, value, prob_dist, tv, tv2);
 
-        return objective;
+        return value;
 }
 
 // initialize working buffers
 static void aux_init(unsigned w, unsigned h, struct coef *coef, struct aux *aux) {
-        float *cos = alloc_real(coef->h * coef->w);
+        aux->w = w;
+        aux->h = h;
+
+        // the quantization is the same every iteration, so convert it to floats once
+        for(unsigned j = 0; j < 64; j++) {
+                aux->quant[j] = coef->quant_table[j];
+                aux->half_quant[j] = 0.5f * aux->quant[j];
+                aux->sq_quant[j] = sqr(aux->quant[j]);
+        }
+        float *dequant = alloc_real(coef->h * coef->w);
         unsigned blocks = (coef->h / 8) * (coef->w / 8);
         for(unsigned i = 0; i < blocks; i++) {
                 for(unsigned j = 0; j < 64; j++) {
-                        cos[i*64+j] = coef->data[i*64+j] * coef->quant_table[j];
+                        dequant[i*64+j] = coef->data[i*64+j] * aux->quant[j];
                 }
         }
-        aux->cos = cos;
+        aux->dequant = dequant;
+        aux->cos = alloc_cold(coef->h * coef->w);
+        cold_from_real(aux->cos, dequant, coef->h * coef->w);
 
+        // touch the planes here, so they are placed in memory for the thread that calls compute()
         for(unsigned i = 0; i < 2; i++) {
                 float *t = alloc_real(h * w);
+                memset(t, 0, sizeof(float) * h * w);
                 aux->temp[i] = t;
         }
         float *obj_gradient = alloc_real(h * w);
+        memset(obj_gradient, 0, sizeof(float) * h * w);
         aux->obj_gradient = obj_gradient;
 
         float *fdata = alloc_real(h * w);
@@ -304,107 +650,197 @@ static void aux_init(unsigned w, unsigned h, struct coef *coef, struct aux *aux)
         free_real(coef->fdata);
         coef->fdata = NULL;
 
-        float *fista = alloc_real(h * w);
-        memcpy(fista, fdata, sizeof(float) * w * h);
-        aux->fista = fista;
+        aux->fista = alloc_cold(h * w);
+        cold_from_real(aux->fista, fdata, h * w);
+}
+
+// initialize working buffers for the coupling channel, only those used by TV and TGV
+static void coupling_init(struct coef *chroma, struct coupling *coupling) {
+        struct aux *aux = &coupling->aux;
+        aux->w = chroma->w;
+        aux->h = chroma->h;
+        coupling->w_samp = chroma->w_samp;
+        coupling->h_samp = chroma->h_samp;
+        aux->cos = NULL;
+        aux->dequant = NULL;
+        aux->fista = NULL;
+        aux->fdata = alloc_real(aux->h * aux->w);
+        aux->obj_gradient = alloc_real(aux->h * aux->w);
+        for(unsigned i = 0; i < 2; i++) {
+                aux->temp[i] = alloc_real(aux->h * aux->w);
+        }
 }
 
 // destroy working buffers, except the fdata that is returned
 static void aux_destroy(struct aux *aux) {
-        free_real(aux->cos);
+        free_cold(aux->cos);
+        free_real(aux->dequant);
         for(unsigned i = 0; i < 2; i++) {
                 free_real(aux->temp[i]);
         }
         free_real(aux->obj_gradient);
-        free_real(aux->fista);
+        free_cold(aux->fista);
+}
+
+// check whether the channels can be optimized together at native resolution
+// this needs full resolution luma and chroma channels that are equally subsampled
+static bool can_couple(unsigned nchannel, struct coef coefs[nchannel]) {
+        if(nchannel != 3) {
+                return false;
+        }
+        struct coef *y = &coefs[0];
+        struct coef *cb = &coefs[1];
+        struct coef *cr = &coefs[2];
+        return y->w_samp == 1 && y->h_samp == 1 &&
+                cb->w == cr->w && cb->h == cr->h &&
+                cb->w_samp == cr->w_samp && cb->h_samp == cr->h_samp &&
+                (cb->w_samp > 1 || cb->h_samp > 1);
+}
+
+// the number of 8x8 blocks that compute() optimizes each iteration, the units it reports progress in
+unsigned long long compute_blocks(unsigned nchannel, struct coef coefs[nchannel], bool native_chroma) {
+        unsigned w = 0;
+        unsigned h = 0;
+        for(unsigned c = 0; c < nchannel; c++) {
+                struct coef *coef = &coefs[c];
+                w = MAX(w, coef->w * coef->w_samp);
+                h = MAX(h, coef->h * coef->h_samp);
+        }
+        bool native = native_chroma && (nchannel == 1 || can_couple(nchannel, coefs));
+        unsigned long long blocks = 0;
+        for(unsigned c = 0; c < nchannel; c++) {
+                struct coef *coef = &coefs[c];
+                if(native) {
+                        blocks += (coef->w / 8) * (coef->h / 8);
+                } else {
+                        blocks += (w / 8) * (h / 8);
+                }
+        }
+        return blocks;
 }
 
 // clamp the DCT values to interval that quantizes to our jpg
-POSSIBLY_UNUSED static void clamp_dct_c(struct coef *coef, float *boxed, unsigned blocks) {
+POSSIBLY_UNUSED static void clamp_dct_c(struct aux *aux, float *boxed, unsigned blocks) {
         for(unsigned i = 0; i < blocks; i++) {
                 for(unsigned j = 0; j < 64; j++) {
-                        float min = (coef->data[i*64+j] - 0.5f) * coef->quant_table[j];
-                        float max = (coef->data[i*64+j] + 0.5f) * coef->quant_table[j];
+                        float min = aux->dequant[i*64+j] - aux->half_quant[j];
+                        float max = aux->dequant[i*64+j] + aux->half_quant[j];
                         boxed[i*64+j] = CLAMP(boxed[i*64+j], min, max);
                 }
         }
 }
 
-// compute projection of data onto the feasible set defined by our jpg
-static void compute_projection(unsigned w, unsigned h, struct aux *aux, struct coef *coef) {
+// make step with distance step_size, then compute projection of data onto the feasible set defined by our jpg
+// when extrapolate is set, also make the FISTA extrapolation for the next iteration
+static void compute_projection(unsigned w, unsigned h, struct aux *aux, struct coef *coef, float step_size, float norm, bool extrapolate, float factor) {
         unsigned blocks = (coef->h / 8) * (coef->w / 8);
-        float *subsampled;
         float *boxed = aux->temp[0];
         bool resample = !(coef->w == w && coef->h == h);
 
         if(resample) {
-                subsampled = aux->temp[1];
+                // step while downsampling and boxing
+                POSSIBLY_SIMD(downsample_box_step)(aux->fdata, aux->obj_gradient, boxed, w, h, coef, step_size, norm);
+        } else if(norm != 0.) {
+                // step while boxing
+                POSSIBLY_SIMD(box_step)(aux->fdata, aux->obj_gradient, boxed, w, h, step_size, norm);
         } else {
-                subsampled = aux->fdata;
-        }
-
-        // downsample and keep the difference
-        // more formally, decompose each subsampling block in the direction of our subsampling vector (a vector of ones)
-        if(resample) {
-                for(unsigned cy = 0; cy < coef->h; cy++) {
-                        for(unsigned cx = 0; cx < coef->w; cx++) {
-                                float mean = 0.;
-                                for(unsigned sy = 0; sy < coef->h_samp; sy++) {
-                                        for(unsigned sx = 0; sx < coef->w_samp; sx++) {
-                                                unsigned y = cy * coef->h_samp + sy;
-                                                unsigned x = cx * coef->w_samp + sx;
-                                                mean += *p(aux->fdata, x, y, w, h);
-                                        }
-                                }
-                                mean /= coef->w_samp * coef->h_samp;
-                                *p(subsampled, cx, cy, coef->w, coef->h) = mean;
-                                for(unsigned sy = 0; sy < coef->h_samp; sy++) {
-                                        for(unsigned sx = 0; sx < coef->w_samp; sx++) {
-                                                unsigned y = cy * coef->h_samp + sy;
-                                                unsigned x = cx * coef->w_samp + sx;
-                                                *p(aux->fdata, x, y, w, h) -= mean;
-                                        }
-                                }
-                        }
-                }
+                box(aux->fdata, boxed, coef->w, coef->h);
         }
 
-        // project onto our DCT box
-        box(subsampled, boxed, coef->w, coef->h);
-
         for(unsigned i = 0; i < blocks; i++) {
                 dct8x8s(&boxed[i*64]);
         }
 
-        POSSIBLY_SIMD(clamp_dct)(coef, boxed, blocks);
+        POSSIBLY_SIMD(clamp_dct)(aux, boxed, blocks);
 
-        memcpy(aux->cos, boxed, coef->w * coef->h * sizeof(float)); // save a copy of the DCT values for step_prob
+        cold_from_real(aux->cos, boxed, coef->w * coef->h); // save a copy of the DCT values for step_prob
 
         for(unsigned i = 0; i < blocks; i++) {
                 idct8x8s(&boxed[i*64]);
         }
 
-        unbox(boxed, subsampled, coef->w, coef->h);
+        if(!resample) {
+                if(extrapolate) {
+                        POSSIBLY_SIMD(unbox_fista)(boxed, aux->fdata, aux->fista, w, h, factor);
+                } else {
+                        unbox(boxed, aux->fdata, coef->w, coef->h);
+                }
+                return;
+        }
 
-        // add back the difference (orthogonal to our subsampling vector)
-        if(resample) {
-                for(unsigned cy = 0; cy < coef->h; cy++) {
-                        for(unsigned cx = 0; cx < coef->w; cx++) {
-                                float mean = *p(subsampled, cx, cy, coef->w, coef->h);
-                                for(unsigned sy = 0; sy < coef->h_samp; sy++) {
-                                        for(unsigned sx = 0; sx < coef->w_samp; sx++) {
-                                                unsigned y = cy * coef->h_samp + sy;
-                                                unsigned x = cx * coef->w_samp + sx;
-                                                *p(aux->fdata, x, y, w, h) += mean;
-                                        }
+        POSSIBLY_SIMD(upsample_unbox_fista)(boxed, aux->fdata, aux->fista, w, h, coef, extrapolate, factor);
+
+        // the padding outside of our jpg is not projected, but still stepped and extrapolated
+        unsigned covered_w = coef->w * coef->w_samp;
+        unsigned covered_h = coef->h * coef->h_samp;
+        for(unsigned y = 0; y < h; y++) {
+                for(unsigned x = y < covered_h ? covered_w : 0; x < w; x++) {
+                        float *here = p(aux->fdata, x, y, w, h);
+                        if(norm != 0.) {
+                                *here = *here - step_size * (*p(aux->obj_gradient, x, y, w, h) / norm);
+                        }
+                        if(extrapolate) {
+                                fista_extrapolate(aux->fdata, aux->fista, y * w + x, *here, factor);
+                        }
+                }
+        }
+}
+
+// factor for the step size when the objective increases again soon after a momentum restart
+static const float adaptive_shrink = 0.5;
+// iterations after an increase in which another increase shrinks the step size
+static const unsigned adaptive_window = 3;
+// the step size is never scaled below this, so long runs keep making progress
+static const float adaptive_floor = 1e-3;
+
+// state of the adaptive step size and momentum restart
+struct adaptive {
+        double objective;
+        float step_scale;
+        // iterations since the objective last increased, at most adaptive_window
+        uint32_t since_increase;
+};
+
+// the state that a checkpoint saves: fdata, fista and the DCT of the last projection of every channel
+static void checkpoint_planes(unsigned nchannel, struct coef coefs[nchannel], struct aux *auxs, struct adaptive *adaptive, void *planes[], size_t sizes[]) {
+        for(unsigned c = 0; c < nchannel; c++) {
+                size_t n = (size_t)auxs[c].w * auxs[c].h;
+                planes[3*c] = auxs[c].fdata;
+                sizes[3*c] = n * sizeof(*auxs[c].fdata);
+                planes[3*c+1] = auxs[c].fista;
+                sizes[3*c+1] = n * sizeof(*auxs[c].fista);
+                planes[3*c+2] = auxs[c].cos;
+                sizes[3*c+2] = (size_t)coefs[c].w * coefs[c].h * sizeof(*auxs[c].cos);
+        }
+        planes[3*nchannel] = adaptive;
+        sizes[3*nchannel] = sizeof(*adaptive);
+}
+
+// start from an earlier result instead of the decoded jpeg
+// seed is w * h at full resolution, and is averaged for channels at native resolution
+static void aux_seed(unsigned w, unsigned h, struct aux *aux, struct coef *coef, unsigned w_samp, unsigned h_samp, float *seed) {
+        for(unsigned y = 0; y < aux->h; y++) {
+                for(unsigned x = 0; x < aux->w; x++) {
+                        float sum = 0.;
+                        for(unsigned sy = 0; sy < h_samp; sy++) {
+                                for(unsigned sx = 0; sx < w_samp; sx++) {
+                                        sum += *p(seed, x * w_samp + sx, y * h_samp + sy, w, h);
                                 }
                         }
+                        *p(aux->fdata, x, y, aux->w, aux->h) = sum / (w_samp * h_samp);
                 }
         }
+        // project onto the feasible set without a step, this also sets the DCT copy for step_prob
+        memset(aux->obj_gradient, 0, sizeof(float) * aux->w * aux->h);
+        compute_projection(aux->w, aux->h, aux, coef, 0., 1., false, 0.);
+        // momentum restarts from the seed
+        cold_from_real(aux->fista, aux->fdata, aux->w * aux->h);
 }
 
 // subgradient method with iteration steps
-void compute(unsigned nchannel, struct coef coefs[nchannel], struct logger *log, struct progressbar *pb, float weight, float pweight[nchannel], unsigned iterations) {
+// with native_chroma subsampled channels are optimized at their own resolution and returned that way
+// a seed continues the run of seed_iterations iterations that produced it
+void compute(unsigned nchannel, struct coef coefs[nchannel], struct logger *log, struct progressbar *pb, float weight, const float pweight[nchannel], unsigned iterations, bool native_chroma, bool adaptive, struct checkpoint *checkpoint, float *seed[], unsigned seed_iterations, struct preview *preview) {
         unsigned h = 0;
         unsigned w = 0;
         for(unsigned c = 0; c < nchannel; c++) {
@@ -414,39 +850,130 @@ void compute(unsigned nchannel, struct coef coefs[nchannel], struct logger *log,
         }
         ASSUME(w % 8 == 0);
         ASSUME(h % 8 == 0);
+        bool native = native_chroma && (nchannel == 1 || can_couple(nchannel, coefs));
+        struct coupling coupling;
+        if(native && nchannel > 1) {
+                coupling_init(&coefs[1], &coupling);
+        }
         // working buffers per channel
         struct aux *auxs = malloc(sizeof(*auxs) * nchannel);
+        // size of the subsampling of channels at native resolution, to return
+        unsigned *w_samps = malloc(sizeof(*w_samps) * nchannel);
+        unsigned *h_samps = malloc(sizeof(*h_samps) * nchannel);
+        float *step_size = malloc(sizeof(*step_size) * nchannel);
+        float *norms = malloc(sizeof(*norms) * nchannel);
+        if(!auxs || !w_samps || !h_samps || !step_size || !norms) { die("could not allocate working buffers"); }
+        unsigned long long blocks = compute_blocks(nchannel, coefs, native_chroma);
+        // all channels are initialized by this thread, which runs the TV and TGV passes over all of them,
+        // so their memory is on the NUMA node of this thread
         for(unsigned c = 0; c < nchannel; c++) {
-                aux_init(w, h, &coefs[c], &auxs[c]);
+                struct coef *coef = &coefs[c];
+                if(native) {
+                        w_samps[c] = coef->w_samp;
+                        h_samps[c] = coef->h_samp;
+                        coef->w_samp = 1;
+                        coef->h_samp = 1;
+                        aux_init(coef->w, coef->h, coef, &auxs[c]);
+                } else {
+                        w_samps[c] = 1;
+                        h_samps[c] = 1;
+                        aux_init(w, h, coef, &auxs[c]);
+                }
+                float radius = sqrtf(auxs[c].w * auxs[c].h) / 2; // radius of [-0.5, 0.5]^(w*h)
+                // with a seed, the steps are those of a single run of all iterations together,
+                // so an already smooth seed is not thrown back by the big steps of a new start
+                step_size[c] = radius / sqrtf(1 + seed_iterations + iterations);
+                if(seed) {
+                        aux_seed(w, h, &auxs[c], coef, w_samps[c], h_samps[c], seed[c]);
+                }
         }
 
-        float radius = sqrtf(w*h) / 2; // radius of [-0.5, 0.5]^(w*h)
+        // FISTA, the first extrapolation is from the starting point to itself
+        // a seed continues the momentum schedule of its run, though its last step is not known
         float t = 1;
-        for(unsigned i = 0; i < iterations; i++) {
+        for(unsigned i = 0; i <= seed_iterations; i++) {
+                t = (1 + sqrtf(1 + 4 * sqr(t))) / 2;
+        }
+        // with adaptive steps, momentum restarts whenever the objective increases, and the step shrinks when that does not help
+        // zeroed including padding, as it is saved to checkpoints
+        struct adaptive state;
+        memset(&state, 0, sizeof(state));
+        state.objective = DBL_MAX;
+        state.step_scale = 1.;
+        state.since_increase = adaptive_window;
+        unsigned start = 0;
+        void *planes[3 * MAX_NCOMPONENT + 1];
+        size_t sizes[3 * MAX_NCOMPONENT + 1];
+        if(checkpoint) {
+                checkpoint_planes(nchannel, coefs, auxs, &state, planes, sizes);
+                if(checkpoint->resume && checkpoint_load(checkpoint, &start, &t, 3 * nchannel + 1, planes, sizes)) {
+                        start = MIN(start, iterations);
+                        if(pb) {
+                                OPENMP(critical(progressbar))
+                                progressbar_add(pb, blocks * start);
+                        }
+                }
+        }
+        for(unsigned i = start; i < iterations; i++) {
                 log->iteration = i;
 
-                // FISTA
-                float tnext = (1 + sqrtf(1 + 4 * sqr(t))) / 2;
-                float factor = (t - 1) / tnext;
-                for(unsigned c = 0; c < nchannel; c++) {
-                        struct aux *aux = &auxs[c];
-                        for(unsigned j = 0; j < w * h; j++) {
-                                aux->fista[j] = aux->fdata[j] + factor * (aux->fdata[j] - aux->fista[j]);
+                // objective gradient
+                double objective = compute_step(nchannel, coefs, auxs, native && nchannel > 1 ? &coupling : NULL, weight, pweight, norms, log, log->f || adaptive);
+                if(adaptive) {
+                        if(objective > state.objective) {
+                                // an isolated increase only restarts the momentum
+                                t = 1;
+                                if(state.since_increase < adaptive_window) {
+                                        state.step_scale = MAX(state.step_scale * adaptive_shrink, adaptive_floor);
+                                }
+                                state.since_increase = 0;
+                        } else if(state.since_increase < adaptive_window) {
+                                state.since_increase++;
                         }
-                        SWAP(float *, aux->fdata, aux->fista);
+                        state.objective = objective;
                 }
-                t = tnext;
 
-                // take a step
-                compute_step(w, h, nchannel, coefs, auxs, radius / sqrtf(1 + iterations), weight, pweight, log);
-                // project back onto feasible set
-                OPENMP(parallel for schedule(dynamic))
+                // FISTA extrapolation for the next iteration
+                bool extrapolate = i + 1 < iterations;
+                float factor = 0.;
+                if(extrapolate) {
+                        float tnext = (1 + sqrtf(1 + 4 * sqr(t))) / 2;
+                        factor = (t - 1) / tnext;
+                        t = tnext;
+                }
+
+                // take a step, project back onto feasible set and extrapolate
+                OPENMP(parallel for schedule(static, 1))
                 for(unsigned c = 0; c < nchannel; c++) {
-                        compute_projection(w, h, &auxs[c], &coefs[c]);
+                        compute_projection(auxs[c].w, auxs[c].h, &auxs[c], &coefs[c], step_size[c] * state.step_scale, norms[c], extrapolate, factor);
                 }
                 if(pb) {
+                        // progress is counted in blocks, so big images weigh more
                         OPENMP(critical(progressbar))
-                        progressbar_inc(pb);
+                        progressbar_add(pb, blocks);
+                }
+                if(checkpoint && checkpoint->interval && (i + 1) % checkpoint->interval == 0 && i + 1 < iterations) {
+                        checkpoint_save(checkpoint, i + 1, t, 3 * nchannel + 1, planes, sizes);
+                }
+                if(preview && i + 1 < iterations && preview_wanted(preview, i + 1)) {
+                        // the preview shows the projected iterate, fdata is the extrapolated point
+                        struct coef current[MAX_NCOMPONENT];
+                        for(unsigned c = 0; c < nchannel; c++) {
+                                size_t n = (size_t)auxs[c].w * auxs[c].h;
+                                current[c] = coefs[c];
+                                current[c].fdata = alloc_real(n);
+                                for(size_t j = 0; j < n; j++) {
+                                        current[c].fdata[j] = cold_get(auxs[c].fista, j);
+                                }
+                                current[c].w = auxs[c].w;
+                                current[c].h = auxs[c].h;
+                                current[c].w_samp = w_samps[c];
+                                current[c].h_samp = h_samps[c];
+                        }
+                        preview_write(preview, nchannel, current);
+                        for(unsigned c = 0; c < nchannel; c++) {
+                                free_real(current[c].fdata);
+                        }
                 }
         }
         // return result
@@ -455,9 +982,19 @@ void compute(unsigned nchannel, struct coef coefs[nchannel], struct logger *log,
                 struct coef *coef = &coefs[c];
                 coef->fdata = aux->fdata;
                 aux->fdata = NULL;
-                coef->w = w;
-                coef->h = h;
+                coef->w = aux->w;
+                coef->h = aux->h;
+                coef->w_samp = w_samps[c];
+                coef->h_samp = h_samps[c];
                 aux_destroy(aux);
         }
+        if(native && nchannel > 1) {
+                free_real(coupling.aux.fdata);
+                aux_destroy(&coupling.aux);
+        }
         free(auxs);
+        free(w_samps);
+        free(h_samps);
+        free(step_size);
+        free(norms);
 }
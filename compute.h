@@ -2,9 +2,13 @@
 #define JPEG2PNG_COMPUTE_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "logger.h"
 #include "progressbar.h"
+#include "checkpoint.h"
+#include "preview.h"
 
-void compute(unsigned nchannel, struct coef coefs[nchannel], struct logger *log, struct progressbar *pb, float weight, float pweight[nchannel], unsigned iterations);
+unsigned long long compute_blocks(unsigned nchannel, struct coef coefs[nchannel], bool native_chroma);
+void compute(unsigned nchannel, struct coef coefs[nchannel], struct logger *log, struct progressbar *pb, float weight, const float pweight[nchannel], unsigned iterations, bool native_chroma, bool adaptive, struct checkpoint *checkpoint, float *seed[], unsigned seed_iterations, struct preview *preview);
 
 #endif
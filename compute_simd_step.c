@@ -4,69 +4,96 @@
 
 // SSE2, optimized versions of functions in compute.c
 
-static double compute_step_prob_simd(unsigned w, unsigned h, float alpha, struct coef *coef, float *cos, float *obj_gradient) {
+// the sampling factors of the JPEG standard, 1 or 2 in each direction
+static bool simd_samp(struct coef *coef) {
+        return coef->w_samp <= 2 && coef->h_samp <= 2;
+}
+
+// 4 samples at the resolution of the jpg, spread over 4 * w_samp pixels in lo and hi
+static ALWAYS_INLINE void upsample_simd(__m128 v, unsigned w_samp, __m128 *lo, __m128 *hi) {
+        if(w_samp == 2) {
+                *lo = _mm_unpacklo_ps(v, v);
+                *hi = _mm_unpackhi_ps(v, v);
+        } else {
+                *lo = v;
+                *hi = v;
+        }
+}
+
+static ALWAYS_INLINE double compute_step_prob_simd_samp(unsigned w, unsigned h, float alpha, struct coef *coef, struct aux *aux, bool objective, unsigned w_samp, unsigned h_samp) {
+        cold_float *cos = aux->cos;
+        float *obj_gradient = aux->obj_gradient;
         double prob_dist = 0.;
         unsigned block_w = coef->w / 8;
         unsigned block_h = coef->h / 8;
         for(unsigned block_y = 0; block_y < block_h; block_y++) {
                 for(unsigned block_x = 0; block_x < block_w; block_x++) {
                         unsigned i = block_y * block_w + block_x;
-                        float *cosb = &cos[i*64];
+                        alignas(16) float buf[64];
+                        float *cosb = real_block(&cos[i*64], buf);
                         for(unsigned j = 0; j < 64; j+=4) {
-                                __m128 coef_data = _mm_cvtpi16_ps(*(__m64 *)&(coef->data[i*64+j]));
-                                __m128 coef_quant_table = _mm_cvtpi16_ps(*(__m64 *)&(coef->quant_table[j]));
-                                _mm_empty();
-
                                 __m128 cosb_j = _mm_load_ps(&cosb[j]);
-                                cosb_j = cosb_j - coef_data * coef_quant_table;
-                                __m128 dist = SQR(cosb_j / coef_quant_table);
-                                prob_dist += dist[0];
-                                prob_dist += dist[1];
-                                prob_dist += dist[2];
-                                prob_dist += dist[3];
-                                cosb_j = cosb_j / SQR(coef_quant_table);
+                                cosb_j = cosb_j - _mm_load_ps(&aux->dequant[i*64+j]);
+                                if(objective) {
+                                        __m128 dist = SQR(cosb_j / _mm_load_ps(&aux->quant[j]));
+                                        prob_dist += dist[0];
+                                        prob_dist += dist[1];
+                                        prob_dist += dist[2];
+                                        prob_dist += dist[3];
+                                }
+                                cosb_j = cosb_j / _mm_load_ps(&aux->sq_quant[j]);
                                 _mm_store_ps(&cosb[j], cosb_j);
                         }
                         idct8x8s(cosb);
-                        if(coef->w_samp > 1 || coef->h_samp > 1) {
+                        if(w_samp <= 2 && h_samp <= 2) {
+                                __m128 malpha = _mm_set_ps1(alpha);
+                                for(unsigned j = 0; j < 64; j+=4) {
+                                        unsigned in_y = j / 8;
+                                        unsigned in_x = j % 8;
+                                        unsigned cx = block_x * 8 + in_x;
+                                        unsigned cy = block_y * 8 + in_y;
+                                        __m128 lo, hi;
+                                        upsample_simd(malpha * _mm_load_ps(&cosb[j]), w_samp, &lo, &hi);
+                                        for(unsigned sy = 0; sy < h_samp; sy++) {
+                                                float *out = &obj_gradient[(cy * h_samp + sy) * w + cx * w_samp];
+                                                _mm_store_ps(out, lo);
+                                                if(w_samp == 2) {
+                                                        _mm_store_ps(out + 4, hi);
+                                                }
+                                        }
+                                }
+                        } else {
                                 for(unsigned in_y = 0; in_y < 8; in_y++) {
                                         for(unsigned in_x = 0; in_x < 8; in_x++) {
                                                 unsigned j = in_y * 8 + in_x;
                                                 unsigned cx = block_x * 8 + in_x;
                                                 unsigned cy = block_y * 8 + in_y;
-                                                for(unsigned sy = 0; sy < coef->h_samp; sy++) {
-                                                        for(unsigned sx = 0; sx < coef->w_samp; sx++) {
-                                                                unsigned y = cy * coef->h_samp + sy;
-                                                                unsigned x = cx * coef->w_samp + sx;
-                                                                *p(obj_gradient, x, y, w, h) += alpha * cosb[j];
+                                                for(unsigned sy = 0; sy < h_samp; sy++) {
+                                                        for(unsigned sx = 0; sx < w_samp; sx++) {
+                                                                unsigned y = cy * h_samp + sy;
+                                                                unsigned x = cx * w_samp + sx;
+                                                                *p(obj_gradient, x, y, w, h) = alpha * cosb[j];
                                                         }
                                                 }
                                         }
                                 }
-                        } else {
-                                __m128 malpha = _mm_set_ps1(alpha);
-                                for(unsigned j = 0; j < 64; j+=4) {
-                                        unsigned in_y = j / 8;
-                                        unsigned in_x = j % 8;
-                                        unsigned x = block_x * 8 + in_x;
-                                        unsigned y = block_y * 8 + in_y;
-                                        __m128 obj = _mm_load_ps(&obj_gradient[y*w+x]);
-                                        __m128 cosb_j = _mm_load_ps(&cosb[j]);
-                                        obj += malpha * cosb_j;
-                                        _mm_store_ps(&obj_gradient[y*w+x], obj);
-                                }
                         }
                 }
         }
-        return 0.5 * prob_dist;
+        // scaled like the gradient, as in compute_step_prob_c
+        return alpha * (0.5 * prob_dist);
+}
+
+static double compute_step_prob_simd(unsigned w, unsigned h, float alpha, struct coef *coef, struct aux *aux, bool objective) {
+        SPECIALIZE_OBJECTIVE(objective, SPECIALIZE_SAMP(coef->w_samp, coef->h_samp, return compute_step_prob_simd_samp(w, h, alpha, coef, aux, OBJECTIVE, W_SAMP, H_SAMP)));
 }
 
-static void compute_step_tv_inner_simd(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], unsigned x, unsigned y, double *tv) {
+static ALWAYS_INLINE void compute_step_tv_inner_simd(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], unsigned x, unsigned y, double *tv) {
         const __m128 minf = _mm_set_ps1(INFINITY);
         const __m128 mzero = _mm_set_ps1(0.);
 
-        __m128 g_xs[3] = {0};
-        __m128 g_ys[3] = {0};
+        __m128 g_xs[MAX_NCOMPONENT] = {0};
+        __m128 g_ys[MAX_NCOMPONENT] = {0};
         for(unsigned c = 0; c < nchannel; c++) {
                 struct aux *aux = &auxs[c];
                 __m128 here = _mm_load_ps(p(aux->fdata, x, y, w, h));
@@ -84,10 +111,12 @@ static void compute_step_tv_inner_simd(unsigned w, unsigned h, unsigned nchannel
         g_norm = _mm_sqrt_ps(g_norm);
 
         float alpha = 1./sqrtf(nchannel);
-        *tv += alpha * g_norm[0];
-        *tv += alpha * g_norm[1];
-        *tv += alpha * g_norm[2];
-        *tv += alpha * g_norm[3];
+        if(tv) {
+                *tv += alpha * g_norm[0];
+                *tv += alpha * g_norm[1];
+                *tv += alpha * g_norm[2];
+                *tv += alpha * g_norm[3];
+        }
 
         __m128 malpha = _mm_set_ps1(alpha);
 
@@ -131,48 +160,53 @@ static void compute_step_tv_inner_simd(unsigned w, unsigned h, unsigned nchannel
         }
 }
 
-static double compute_step_tv_simd(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel]) {
+static ALWAYS_INLINE double compute_step_tv_simd_n(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], double *sq_norms, bool objective) {
         if(w < 4) {
-                return compute_step_tv_c(w, h, nchannel, auxs);
+                return compute_step_tv_c(w, h, nchannel, auxs, sq_norms, objective);
         }
 
         double tv = 0.;
-        ASSUME(nchannel <= 3);
+        double *ptv = objective ? &tv : NULL;
+        ASSUME(nchannel <= MAX_NCOMPONENT);
         for(unsigned y = 0; y < h-1; y++) {
                 for(unsigned x = 0; x < w-4; x+=4) {
-                        compute_step_tv_inner_simd(w, h, nchannel, auxs, x, y, &tv);
+                        compute_step_tv_inner_simd(w, h, nchannel, auxs, x, y, ptv);
                 }
                 for(unsigned x = w-4; x < w; x++) {
-                        compute_step_tv_inner_c(w, h, nchannel, auxs, x, y, &tv);
+                        compute_step_tv_inner_c(w, h, nchannel, auxs, x, y, ptv);
                 }
+                accumulate_norms(w, h, nchannel, auxs, y, sq_norms);
         }
         for(unsigned x = 0; x < w; x++) {
-                compute_step_tv_inner_c(w, h, nchannel, auxs, x, h-1, &tv);
+                compute_step_tv_inner_c(w, h, nchannel, auxs, x, h-1, ptv);
         }
+        accumulate_norms(w, h, nchannel, auxs, h-1, sq_norms);
         return tv;
 }
 
-static void clamp_dct_simd(struct coef *coef, float *boxed, unsigned blocks) {
-        __m128 mhalf = _mm_set_ps1(0.5);
+static double compute_step_tv_simd(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], double *sq_norms, bool objective) {
+        SPECIALIZE_OBJECTIVE(objective, SPECIALIZE_NCHANNEL(nchannel, return compute_step_tv_simd_n(w, h, NCHANNEL, auxs, sq_norms, OBJECTIVE)));
+}
+
+static void clamp_dct_simd(struct aux *aux, float *boxed, unsigned blocks) {
         for(unsigned i = 0; i < blocks; i++) {
                 for(unsigned j = 0; j < 64; j+=4) {
-                        __m128 coef_data = _mm_cvtpi16_ps(*(__m64 *)&(coef->data[i*64+j]));
-                        __m128 coef_quant_table = _mm_cvtpi16_ps(*(__m64 *)&(coef->quant_table[j]));
+                        __m128 dequant = _mm_load_ps(&aux->dequant[i*64+j]);
+                        __m128 half_quant = _mm_load_ps(&aux->half_quant[j]);
 
-                        __m128 min = (coef_data - mhalf) * coef_quant_table;
-                        __m128 max = (coef_data + mhalf) * coef_quant_table;
+                        __m128 min = dequant - half_quant;
+                        __m128 max = dequant + half_quant;
                         __m128 data = _mm_load_ps(&boxed[i*64+j]);
                         data =_mm_max_ps(min, _mm_min_ps(max, data));
                         _mm_store_ps(&boxed[i*64+j], data);
                 }
         }
-        _mm_empty();
 }
 
-static void compute_step_tv2_inner_simd(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], float alpha, unsigned x, unsigned y, double *tv2) {
-        __m128 g_xxs[3] = {0};
-        __m128 g_xy_syms[3] = {0};
-        __m128 g_yys[3] = {0};
+static ALWAYS_INLINE void compute_step_tv2_inner_simd(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], float alpha, unsigned x, unsigned y, double *tv2) {
+        __m128 g_xxs[MAX_NCOMPONENT] = {0};
+        __m128 g_xy_syms[MAX_NCOMPONENT] = {0};
+        __m128 g_yys[MAX_NCOMPONENT] = {0};
 
         const __m128 mtwo = _mm_set_ps1(2.);
         const __m128 minf = _mm_set_ps1(INFINITY);
@@ -205,11 +239,13 @@ static void compute_step_tv2_inner_simd(unsigned w, unsigned h, unsigned nchanne
         }
         g2_norm = _mm_sqrt_ps(g2_norm);
 
-        __m128 alpha_norm = malpha * g2_norm;
-        *tv2 += alpha_norm[0];
-        *tv2 += alpha_norm[1];
-        *tv2 += alpha_norm[2];
-        *tv2 += alpha_norm[3];
+        if(tv2) {
+                __m128 alpha_norm = malpha * g2_norm;
+                *tv2 += alpha_norm[0];
+                *tv2 += alpha_norm[1];
+                *tv2 += alpha_norm[2];
+                *tv2 += alpha_norm[3];
+        }
 
         // set zeroes to infinity
         g2_norm = _mm_or_ps(g2_norm, _mm_and_ps(minf, _mm_cmpeq_ps(g2_norm, mzero)));
@@ -273,28 +309,180 @@ static void compute_step_tv2_inner_simd(unsigned w, unsigned h, unsigned nchanne
         }
 }
 
-static double compute_step_tv2_simd(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], float alpha) {
+static ALWAYS_INLINE double compute_step_tv2_simd_n(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], float alpha, double *sq_norms, bool objective) {
         if(w < 8 || h < 2) {
-                return compute_step_tv2_c(w, h, nchannel, auxs, alpha);
+                return compute_step_tv2_c(w, h, nchannel, auxs, alpha, sq_norms, objective);
         }
 
         double tv2 = 0.;
+        double *ptv2 = objective ? &tv2 : NULL;
         for(unsigned x = 0; x < w; x++) {
-                compute_step_tv2_inner_c(w, h, nchannel, auxs, alpha, x, 0, &tv2);
+                compute_step_tv2_inner_c(w, h, nchannel, auxs, alpha, x, 0, ptv2);
         }
         for(unsigned y = 1; y < h-1; y++) {
                 for(unsigned x = 0; x < 4; x++) {
-                        compute_step_tv2_inner_c(w, h, nchannel, auxs, alpha, x, y, &tv2);
+                        compute_step_tv2_inner_c(w, h, nchannel, auxs, alpha, x, y, ptv2);
                 }
                 for(unsigned x = 4; x < w-4; x+=4) {
-                        compute_step_tv2_inner_simd(w, h, nchannel, auxs, alpha, x, y, &tv2);
+                        compute_step_tv2_inner_simd(w, h, nchannel, auxs, alpha, x, y, ptv2);
                 }
                 for(unsigned x = w-4; x < w; x++) {
-                        compute_step_tv2_inner_c(w, h, nchannel, auxs, alpha, x, y, &tv2);
+                        compute_step_tv2_inner_c(w, h, nchannel, auxs, alpha, x, y, ptv2);
                 }
+                accumulate_norms(w, h, nchannel, auxs, y-1, sq_norms);
         }
         for(unsigned x = 0; x < w; x++) {
-                compute_step_tv2_inner_c(w, h, nchannel, auxs, alpha, x, h-1, &tv2);
+                compute_step_tv2_inner_c(w, h, nchannel, auxs, alpha, x, h-1, ptv2);
         }
+        accumulate_norms(w, h, nchannel, auxs, h-2, sq_norms);
+        accumulate_norms(w, h, nchannel, auxs, h-1, sq_norms);
         return tv2;
 }
+
+static double compute_step_tv2_simd(unsigned w, unsigned h, unsigned nchannel, struct aux auxs[nchannel], float alpha, double *sq_norms, bool objective) {
+        SPECIALIZE_OBJECTIVE(objective, SPECIALIZE_NCHANNEL(nchannel, return compute_step_tv2_simd_n(w, h, NCHANNEL, auxs, alpha, sq_norms, OBJECTIVE)));
+}
+
+static void box_step_simd(float *fdata, float *obj_gradient, float *boxed, unsigned w, unsigned h, float step_size, float norm) {
+        __m128 mstep_size = _mm_set_ps1(step_size);
+        __m128 mnorm = _mm_set_ps1(norm);
+        for(unsigned block_y = 0; block_y < h / 8; block_y++) {
+                for(unsigned block_x = 0; block_x < w / 8; block_x++) {
+                        for(unsigned in_y = 0; in_y < 8; in_y++) {
+                                unsigned i = (block_y * 8 + in_y) * w + block_x * 8;
+                                for(unsigned in_x = 0; in_x < 8; in_x += 4) {
+                                        __m128 data = _mm_load_ps(&fdata[i + in_x]);
+                                        __m128 obj = _mm_load_ps(&obj_gradient[i + in_x]);
+                                        _mm_store_ps(boxed, data - mstep_size * (obj / mnorm));
+                                        boxed += 4;
+                                }
+                        }
+                }
+        }
+}
+
+static ALWAYS_INLINE void fista_extrapolate_simd(float *fdata, cold_float *fista, unsigned i, __m128 x, __m128 mfactor) {
+#ifdef USE_F16C
+        __m128i *pfista = (__m128i *)&fista[i];
+        __m128 prev = _mm_cvtph_ps(_mm_loadl_epi64(pfista));
+        _mm_storel_epi64(pfista, _mm_cvtps_ph(x, _MM_FROUND_TO_NEAREST_INT));
+#else
+        __m128 prev = _mm_load_ps(&fista[i]);
+        _mm_store_ps(&fista[i], x);
+#endif
+        _mm_store_ps(&fdata[i], x + mfactor * (x - prev));
+}
+
+static void unbox_fista_simd(float *boxed, float *fdata, cold_float *fista, unsigned w, unsigned h, float factor) {
+        __m128 mfactor = _mm_set_ps1(factor);
+        for(unsigned block_y = 0; block_y < h / 8; block_y++) {
+                for(unsigned block_x = 0; block_x < w / 8; block_x++) {
+                        for(unsigned in_y = 0; in_y < 8; in_y++) {
+                                unsigned i = (block_y * 8 + in_y) * w + block_x * 8;
+                                for(unsigned in_x = 0; in_x < 8; in_x += 4) {
+                                        __m128 x = _mm_load_ps(boxed);
+                                        boxed += 4;
+                                        fista_extrapolate_simd(fdata, fista, i + in_x, x, mfactor);
+                                }
+                        }
+                }
+        }
+}
+
+static ALWAYS_INLINE __m128 load_step_simd(float *fdata, float *obj_gradient, unsigned i, bool step, __m128 mstep_size, __m128 mnorm) {
+        __m128 data = _mm_load_ps(&fdata[i]);
+        if(step) {
+                data = data - mstep_size * (_mm_load_ps(&obj_gradient[i]) / mnorm);
+        }
+        return data;
+}
+
+static ALWAYS_INLINE void downsample_box_step_simd_samp(float *fdata, float *obj_gradient, float *boxed, unsigned w, unsigned h, struct coef *coef, float step_size, float norm, unsigned w_samp, unsigned h_samp) {
+        (void) h;
+        bool step = norm != 0.;
+        __m128 mstep_size = _mm_set_ps1(step_size);
+        __m128 mnorm = _mm_set_ps1(norm);
+        __m128 mscale = _mm_set_ps1(1.f / (w_samp * h_samp));
+        for(unsigned block_y = 0; block_y < coef->h / 8; block_y++) {
+                for(unsigned block_x = 0; block_x < coef->w / 8; block_x++) {
+                        for(unsigned in_y = 0; in_y < 8; in_y++) {
+                                unsigned cy = block_y * 8 + in_y;
+                                for(unsigned in_x = 0; in_x < 8; in_x += 4) {
+                                        unsigned cx = block_x * 8 + in_x;
+                                        // same order of additions as the C version
+                                        __m128 mean = _mm_setzero_ps();
+                                        __m128 lo[2], hi[2];
+                                        for(unsigned sy = 0; sy < h_samp; sy++) {
+                                                unsigned i = (cy * h_samp + sy) * w + cx * w_samp;
+                                                lo[sy] = load_step_simd(fdata, obj_gradient, i, step, mstep_size, mnorm);
+                                                if(w_samp == 2) {
+                                                        hi[sy] = load_step_simd(fdata, obj_gradient, i + 4, step, mstep_size, mnorm);
+                                                        mean = mean + _mm_shuffle_ps(lo[sy], hi[sy], _MM_SHUFFLE(2, 0, 2, 0));
+                                                        mean = mean + _mm_shuffle_ps(lo[sy], hi[sy], _MM_SHUFFLE(3, 1, 3, 1));
+                                                } else {
+                                                        mean = mean + lo[sy];
+                                                }
+                                        }
+                                        // exact, the scale is a power of 2
+                                        mean = mean * mscale;
+                                        _mm_store_ps(boxed, mean);
+                                        boxed += 4;
+                                        __m128 mean_lo, mean_hi;
+                                        upsample_simd(mean, w_samp, &mean_lo, &mean_hi);
+                                        for(unsigned sy = 0; sy < h_samp; sy++) {
+                                                unsigned i = (cy * h_samp + sy) * w + cx * w_samp;
+                                                _mm_store_ps(&fdata[i], lo[sy] - mean_lo);
+                                                if(w_samp == 2) {
+                                                        _mm_store_ps(&fdata[i + 4], hi[sy] - mean_hi);
+                                                }
+                                        }
+                                }
+                        }
+                }
+        }
+}
+
+static void downsample_box_step_simd(float *fdata, float *obj_gradient, float *boxed, unsigned w, unsigned h, struct coef *coef, float step_size, float norm) {
+        if(!simd_samp(coef)) {
+                downsample_box_step_c(fdata, obj_gradient, boxed, w, h, coef, step_size, norm);
+                return;
+        }
+        SPECIALIZE_SAMP(coef->w_samp, coef->h_samp, downsample_box_step_simd_samp(fdata, obj_gradient, boxed, w, h, coef, step_size, norm, W_SAMP, H_SAMP));
+}
+
+static ALWAYS_INLINE void upsample_unbox_fista_simd_samp(float *boxed, float *fdata, cold_float *fista, unsigned w, unsigned h, struct coef *coef, bool extrapolate, float factor, unsigned w_samp, unsigned h_samp) {
+        (void) h;
+        __m128 mfactor = _mm_set_ps1(factor);
+        for(unsigned block_y = 0; block_y < coef->h / 8; block_y++) {
+                for(unsigned block_x = 0; block_x < coef->w / 8; block_x++) {
+                        for(unsigned in_y = 0; in_y < 8; in_y++) {
+                                unsigned cy = block_y * 8 + in_y;
+                                for(unsigned in_x = 0; in_x < 8; in_x += 4) {
+                                        unsigned cx = block_x * 8 + in_x;
+                                        __m128 mean_lo, mean_hi;
+                                        upsample_simd(_mm_load_ps(boxed), w_samp, &mean_lo, &mean_hi);
+                                        boxed += 4;
+                                        for(unsigned sy = 0; sy < h_samp; sy++) {
+                                                unsigned i = (cy * h_samp + sy) * w + cx * w_samp;
+                                                for(unsigned sx = 0; sx < w_samp; sx++) {
+                                                        __m128 x = _mm_load_ps(&fdata[i + 4 * sx]) + (sx ? mean_hi : mean_lo);
+                                                        if(extrapolate) {
+                                                                fista_extrapolate_simd(fdata, fista, i + 4 * sx, x, mfactor);
+                                                        } else {
+                                                                _mm_store_ps(&fdata[i + 4 * sx], x);
+                                                        }
+                                                }
+                                        }
+                                }
+                        }
+                }
+        }
+}
+
+static void upsample_unbox_fista_simd(float *boxed, float *fdata, cold_float *fista, unsigned w, unsigned h, struct coef *coef, bool extrapolate, float factor) {
+        if(!simd_samp(coef)) {
+                upsample_unbox_fista_c(boxed, fdata, fista, w, h, coef, extrapolate, factor);
+                return;
+        }
+        SPECIALIZE_SAMP(coef->w_samp, coef->h_samp, upsample_unbox_fista_simd_samp(boxed, fdata, fista, w, h, coef, extrapolate, factor, W_SAMP, H_SAMP));
+}
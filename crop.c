@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "crop.h"
+#include "utils.h"
+
+// pixels around the crop that are optimized too, so its edges are like in the whole picture
+static const unsigned crop_halo = 16;
+
+static unsigned gcd(unsigned a, unsigned b) {
+        while(b) {
+                unsigned t = a % b;
+                a = b;
+                b = t;
+        }
+        return a;
+}
+
+// copy one component cut to the block rectangle bx0..bx1, by0..by1
+static void crop_coef(const struct coef *in, struct coef *out, unsigned bx0, unsigned by0, unsigned bx1, unsigned by1) {
+        *out = *in;
+        out->w = (bx1 - bx0) * 8;
+        out->h = (by1 - by0) * 8;
+        if(in->data) {
+                out->data = malloc(sizeof(*out->data) * out->w * out->h);
+                if(!out->data) { die("could not allocate memory for coefs"); }
+                for(unsigned by = by0; by < by1; by++) {
+                        memcpy(&out->data[(by - by0) * (bx1 - bx0) * 64], &in->data[(by * (in->w / 8) + bx0) * 64], sizeof(*out->data) * (bx1 - bx0) * 64);
+                }
+        }
+}
+
+// copy only the blocks needed for the crop and a halo around it, aligned to whole MCUs
+// the crop is changed to be relative to the smaller picture
+// without coefficients only the sizes are set, for estimates from the header
+void crop_copy(const struct jpeg *jpeg, struct crop *crop, struct jpeg *out) {
+        if(crop->w == 0 || crop->h == 0 || crop->x >= jpeg->w || crop->y >= jpeg->h || crop->w > jpeg->w - crop->x || crop->h > jpeg->h - crop->y) {
+                die("crop %ux%u+%u+%u is outside of the %ux%u picture", crop->w, crop->h, crop->x, crop->y, jpeg->w, jpeg->h);
+        }
+        // size of an MCU in pixels, so every component is cut at block boundaries
+        unsigned mcu_w = 1;
+        unsigned mcu_h = 1;
+        for(unsigned c = 0; c < jpeg->ncomponent; c++) {
+                const struct coef *coef = &jpeg->coefs[c];
+                mcu_w = mcu_w / gcd(mcu_w, coef->w_samp) * coef->w_samp;
+                mcu_h = mcu_h / gcd(mcu_h, coef->h_samp) * coef->h_samp;
+        }
+        mcu_w *= 8;
+        mcu_h *= 8;
+        unsigned x0 = crop->x > crop_halo ? (crop->x - crop_halo) / mcu_w * mcu_w : 0;
+        unsigned y0 = crop->y > crop_halo ? (crop->y - crop_halo) / mcu_h * mcu_h : 0;
+        unsigned x1 = (crop->x + crop->w + crop_halo + mcu_w - 1) / mcu_w * mcu_w;
+        unsigned y1 = (crop->y + crop->h + crop_halo + mcu_h - 1) / mcu_h * mcu_h;
+        *out = *jpeg;
+        for(unsigned c = 0; c < jpeg->ncomponent; c++) {
+                const struct coef *coef = &jpeg->coefs[c];
+                unsigned bw = 8 * coef->w_samp;
+                unsigned bh = 8 * coef->h_samp;
+                crop_coef(coef, &out->coefs[c], x0 / bw, y0 / bh, MIN((x1 + bw - 1) / bw, coef->w / 8), MIN((y1 + bh - 1) / bh, coef->h / 8));
+        }
+        out->w = MIN(x1, jpeg->w) - x0;
+        out->h = MIN(y1, jpeg->h) - y0;
+        crop->x -= x0;
+        crop->y -= y0;
+}
+
+// keep only the blocks needed for the crop, like crop_copy but in place
+void crop_jpeg(struct jpeg *jpeg, struct crop *crop) {
+        struct jpeg cropped;
+        crop_copy(jpeg, crop, &cropped);
+        for(unsigned c = 0; c < jpeg->ncomponent; c++) {
+                free(jpeg->coefs[c].data);
+        }
+        *jpeg = cropped;
+}
+
+// cut the crop out of the full size planes of the result
+void crop_planes(struct jpeg *jpeg, struct crop *crop) {
+        for(unsigned c = 0; c < jpeg->ncomponent; c++) {
+                struct coef *coef = &jpeg->coefs[c];
+                float *fdata = alloc_real(crop->w * crop->h);
+                for(unsigned y = 0; y < crop->h; y++) {
+                        memcpy(&fdata[y * crop->w], p(coef->fdata, crop->x, crop->y + y, coef->w, coef->h), sizeof(float) * crop->w);
+                }
+                free_real(coef->fdata);
+                coef->fdata = fdata;
+                coef->w = crop->w;
+                coef->h = crop->h;
+        }
+        jpeg->w = crop->w;
+        jpeg->h = crop->h;
+}
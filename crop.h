@@ -0,0 +1,18 @@
+#ifndef JPEG2PNG_CROP_H
+#define JPEG2PNG_CROP_H
+
+#include "jpeg.h"
+
+// rectangle of the picture to decode, in pixels
+struct crop {
+        unsigned x;
+        unsigned y;
+        unsigned w;
+        unsigned h;
+};
+
+void crop_copy(const struct jpeg *jpeg, struct crop *crop, struct jpeg *out);
+void crop_jpeg(struct jpeg *jpeg, struct crop *crop);
+void crop_planes(struct jpeg *jpeg, struct crop *crop);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef JPEG2PNG_HALF_H
+#define JPEG2PNG_HALF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "utils.h"
+
+// storage for planes that are only read and written once per iteration
+// with USE_F16C these are half precision floats, halving their memory traffic
+#ifdef USE_F16C
+#include <immintrin.h>
+typedef uint16_t cold_float;
+#else
+typedef float cold_float;
+#endif
+
+// allocate aligned buffer of n cold floats, n a multiple of 4
+static inline cold_float *alloc_cold(size_t n) {
+#ifdef USE_F16C
+        return (cold_float *)alloc_real((n + 1) / 2);
+#else
+        return alloc_real(n);
+#endif
+}
+
+static inline void free_cold(cold_float *p) {
+        free_real((float *)p);
+}
+
+// convert n floats to cold floats, n a multiple of 4
+static inline void cold_from_real(cold_float *restrict out, const float *restrict in, size_t n) {
+#ifdef USE_F16C
+        for(size_t i = 0; i < n; i += 4) {
+                __m128i h = _mm_cvtps_ph(_mm_load_ps(&in[i]), _MM_FROUND_TO_NEAREST_INT);
+                _mm_storel_epi64((__m128i *)&out[i], h);
+        }
+#else
+        memcpy(out, in, n * sizeof(float));
+#endif
+}
+
+// get element i of cold floats
+static inline float cold_get(const cold_float *in, size_t i) {
+#ifdef USE_F16C
+        return _cvtsh_ss(in[i]);
+#else
+        return in[i];
+#endif
+}
+
+// set element i of cold floats
+static inline void cold_set(cold_float *out, size_t i, float x) {
+#ifdef USE_F16C
+        out[i] = _cvtss_sh(x, _MM_FROUND_TO_NEAREST_INT);
+#else
+        out[i] = x;
+#endif
+}
+
+// get a block of 64 cold floats as floats
+// buf is used when a conversion is needed, otherwise the block itself is returned
+static inline float *real_block(cold_float *in, float buf[64]) {
+#ifdef USE_F16C
+        for(unsigned i = 0; i < 64; i += 4) {
+                _mm_store_ps(&buf[i], _mm_cvtph_ps(_mm_loadl_epi64((__m128i *)&in[i])));
+        }
+        return buf;
+#else
+        (void)buf;
+        return in;
+#endif
+}
+
+#endif
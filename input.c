@@ -0,0 +1,76 @@
+#ifndef _WIN32
+  #define _POSIX_C_SOURCE 200112L
+  #include <sys/types.h>
+  #include <sys/stat.h>
+  #include <sys/mman.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "input.h"
+#include "utils.h"
+
+// read the whole file into memory, for files that can't be mapped
+static void input_read(const char *filename, struct input *input) {
+        FILE *in = fopen(filename, "rb");
+        if(!in) { die_perror("could not open input file `%s`", filename); }
+        size_t capacity = 1 << 20;
+        size_t size = 0;
+        unsigned char *data = malloc(capacity);
+        if(!data) { die("could not allocate memory for input file `%s`", filename); }
+        while(true) {
+                size += fread(data + size, 1, capacity - size, in);
+                if(size < capacity) {
+                        break;
+                }
+                capacity *= 2;
+                data = realloc(data, capacity);
+                if(!data) { die("could not allocate memory for input file `%s`", filename); }
+        }
+        if(ferror(in)) { die_perror("could not read input file `%s`", filename); }
+        fclose(in);
+        input->data = data;
+        input->size = size;
+        input->mapped = false;
+}
+
+// open input file, mapping it into memory when it is a regular file
+// the file is read sequentially once, so tell the kernel to read ahead
+void input_open(const char *filename, struct input *input) {
+#ifdef _WIN32
+        input_read(filename, input);
+#else
+        int fd = open(filename, O_RDONLY);
+        if(fd < 0) { die_perror("could not open input file `%s`", filename); }
+        struct stat st;
+        if(fstat(fd, &st) != 0) { die_perror("could not get size of input file `%s`", filename); }
+        void *data = MAP_FAILED;
+        if(S_ISREG(st.st_mode) && st.st_size > 0) {
+                data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if(data == MAP_FAILED) {
+                input_read(filename, input);
+                return;
+        }
+        posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+        input->data = data;
+        input->size = st.st_size;
+        input->mapped = true;
+#endif
+}
+
+// close input file, unmapping or freeing its contents
+void input_close(struct input *input) {
+        if(input->mapped) {
+#ifndef _WIN32
+                munmap((void *)input->data, input->size);
+#endif
+        } else {
+                free((void *)input->data);
+        }
+        input->data = NULL;
+        input->size = 0;
+}
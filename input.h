@@ -0,0 +1,17 @@
+#ifndef JPEG2PNG_INPUT_H
+#define JPEG2PNG_INPUT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// input file contents, memory mapped when possible
+struct input {
+        const unsigned char *data;
+        size_t size;
+        bool mapped;
+};
+
+void input_open(const char *filename, struct input *input);
+void input_close(struct input *input);
+
+#endif
@@ -5,6 +5,7 @@
 #include <string.h>
 
 #include <jpeglib.h>
+#include <jerror.h>
 
 #include "jpeg.h"
 #include "utils.h"
@@ -18,25 +19,98 @@ static void die_output_message(struct jpeg_common_struct *c) {
         fprintf(stderr, "libjpeg error: %s\n", error_message);
 }
 
-// read JPEG file DCT coefficients and quantization tables
-void read_jpeg(FILE *in, struct jpeg *jpeg) {
-        struct jpeg_decompress_struct d;
-        struct jpeg_error_mgr jerr;
-        d.err = jpeg_std_error(&jerr);
-        d.err->output_message = die_output_message;
-        jpeg_create_decompress(&d);
-        jpeg_stdio_src(&d, in);
-        jpeg_read_header(&d, true);
+// source manager reading directly from the input file contents, without copying
+static void source_init(j_decompress_ptr d) {
+        (void)d;
+}
 
-        jpeg->h = d.image_height;
-        jpeg->w = d.image_width;
+// all data is given at once, so reaching here means the file is truncated
+static boolean source_fill(j_decompress_ptr d) {
+        static const JOCTET eoi[2] = {0xFF, JPEG_EOI};
+        WARNMS(d, JWRN_JPEG_EOF);
+        d->src->next_input_byte = eoi;
+        d->src->bytes_in_buffer = 2;
+        return true;
+}
 
-        if(d.num_components != 3) { die("only 3 component jpegs are supported"); }
+static void source_skip(j_decompress_ptr d, long n) {
+        if(n <= 0) {
+                return;
+        }
+        struct jpeg_source_mgr *src = d->src;
+        if((size_t)n > src->bytes_in_buffer) {
+                source_fill(d);
+        } else {
+                src->next_input_byte += n;
+                src->bytes_in_buffer -= n;
+        }
+}
 
-        for(int c = 0; c < d.num_components; c++) {
-                unsigned i = d.comp_info[c].quant_tbl_no;
+static void source_term(j_decompress_ptr d) {
+        (void)d;
+}
+
+// read from input file contents
+static void input_src(j_decompress_ptr d, struct input *input) {
+        struct jpeg_source_mgr *src = d->mem->alloc_small((j_common_ptr)d, JPOOL_PERMANENT, sizeof(*src));
+        src->init_source = source_init;
+        src->fill_input_buffer = source_fill;
+        src->skip_input_data = source_skip;
+        src->resync_to_restart = jpeg_resync_to_restart;
+        src->term_source = source_term;
+        src->next_input_byte = input->data;
+        src->bytes_in_buffer = input->size;
+        d->src = src;
+}
+
+// set up decompressor reading from input and read the JPEG header
+static void start_decompress(struct jpeg_decompress_struct *d, struct jpeg_error_mgr *jerr, struct input *in) {
+        d->err = jpeg_std_error(jerr);
+        d->err->output_message = die_output_message;
+        jpeg_create_decompress(d);
+        input_src(d, in);
+        jpeg_read_header(d, true);
+
+        if(d->num_components == 4 && d->jpeg_color_space != JCS_CMYK && d->jpeg_color_space != JCS_YCCK) {
+                die("4 component jpegs must be CMYK or YCCK");
+        }
+        if(d->num_components != 1 && d->num_components != 3 && d->num_components != 4) {
+                die("only 1, 3 and 4 component jpegs are supported");
+        }
+}
+
+// copy image and component sizes, available after reading the header
+static void read_geometry(struct jpeg_decompress_struct *d, struct jpeg *jpeg) {
+        jpeg->h = d->image_height;
+        jpeg->w = d->image_width;
+        jpeg->ncomponent = d->num_components;
+        jpeg->inverted = false;
+        if(d->num_components == 1) {
+                jpeg->color = COLOR_GRAY;
+        } else if(d->num_components == 3) {
+                jpeg->color = COLOR_YCBCR;
+        } else {
+                jpeg->color = d->jpeg_color_space == JCS_YCCK ? COLOR_YCCK : COLOR_CMYK;
+                jpeg->inverted = d->saw_Adobe_marker;
+        }
+
+        for(int c = 0; c < d->num_components; c++) {
+                jpeg_component_info *i = &d->comp_info[c];
+                jpeg->coefs[c].w = i->width_in_blocks * 8;
+                jpeg->coefs[c].h = i->height_in_blocks * 8;
+                jpeg->coefs[c].w_samp = d->max_h_samp_factor / i->h_samp_factor;
+                jpeg->coefs[c].h_samp = d->max_v_samp_factor / i->v_samp_factor;
+                jpeg->coefs[c].data = NULL;
+                jpeg->coefs[c].fdata = NULL;
+        }
+}
+
+// copy the quantization table of each component, also available after reading the header
+static void read_quant_tables(struct jpeg_decompress_struct *d, struct jpeg *jpeg) {
+        for(int c = 0; c < d->num_components; c++) {
+                unsigned i = d->comp_info[c].quant_tbl_no;
                 if(i >= NUM_QUANT_TBLS) { die("weird jpeg: invalid quant_tbl_no"); }
-                JQUANT_TBL *t = d.quant_tbl_ptrs[i];
+                JQUANT_TBL *t = d->quant_tbl_ptrs[i];
                 if(!t) { die("weird jpeg: no quant table pointer"); }
                 for(unsigned j = 0; j < 64; j++) {
                         if(t->quantval[j] == 0) {
@@ -45,17 +119,31 @@ void read_jpeg(FILE *in, struct jpeg *jpeg) {
                 }
                 memcpy(&(jpeg->coefs[c].quant_table), t->quantval, sizeof(uint16_t) * 64);
         }
+}
+
+// read only the JPEG header, filling in the sizes and quantization tables but no coefficients
+void read_jpeg_header(struct input *in, struct jpeg *jpeg) {
+        struct jpeg_decompress_struct d;
+        struct jpeg_error_mgr jerr;
+        start_decompress(&d, &jerr, in);
+        read_geometry(&d, jpeg);
+        read_quant_tables(&d, jpeg);
+        jpeg_destroy_decompress(&d);
+}
+
+// read JPEG file DCT coefficients and quantization tables
+void read_jpeg(struct input *in, struct jpeg *jpeg) {
+        struct jpeg_decompress_struct d;
+        struct jpeg_error_mgr jerr;
+        start_decompress(&d, &jerr, in);
+        read_geometry(&d, jpeg);
+        read_quant_tables(&d, jpeg);
 
         jvirt_barray_ptr *coefs = jpeg_read_coefficients(&d);
         for(int c = 0; c < d.num_components; c++) {
-                jpeg_component_info *i = &d.comp_info[c];
-                unsigned h = i->height_in_blocks * 8;
-                unsigned w = i->width_in_blocks * 8;
+                unsigned h = jpeg->coefs[c].h;
+                unsigned w = jpeg->coefs[c].w;
                 int16_t *data = malloc(w * h * sizeof(*data));
-                jpeg->coefs[c].w = w;
-                jpeg->coefs[c].h = h;
-                jpeg->coefs[c].w_samp = d.max_h_samp_factor / i->h_samp_factor;
-                jpeg->coefs[c].h_samp = d.max_v_samp_factor / i->v_samp_factor;
                 jpeg->coefs[c].data = data;
                 if(!data) { die("could not allocate memory for coefs"); }
                 for(unsigned y = 0; y < h / 8; y++) {
@@ -3,15 +3,30 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "jpeg2png.h"
+#include "input.h"
+
+// color space of the components
+enum color {
+        COLOR_GRAY,
+        COLOR_YCBCR,
+        COLOR_CMYK,
+        COLOR_YCCK,
+};
 
 struct jpeg {
         unsigned h;
         unsigned w;
-        struct coef coefs[3];
+        enum color color;
+        // CMYK values are stored inverted, as Adobe does
+        bool inverted;
+        unsigned ncomponent;
+        struct coef coefs[MAX_NCOMPONENT];
 };
 
-void read_jpeg(FILE *in, struct jpeg *jpeg);
+void read_jpeg_header(struct input *in, struct jpeg *jpeg);
+void read_jpeg(struct input *in, struct jpeg *jpeg);
 void decode_coefficients(struct coef *coef);
 #endif
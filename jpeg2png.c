@@ -12,13 +12,24 @@
 #include "utils.h"
 #include "jpeg.h"
 #include "png.h"
+#include "output.h"
+#include "cache.h"
+#include "sha256.h"
 #include "box.h"
+#include "resample.h"
 #include "compute.h"
+#include "checkpoint.h"
+#include "preview.h"
+#include "crop.h"
+#include "budget.h"
+#include "affinity.h"
 #include "logger.h"
 #include "progressbar.h"
 #include "fp_exceptions.h"
 
 #define JPEG2PNG_VERSION "1.0"
+// change when the output for the same options changes, to invalidate cached results and checkpoints
+#define JPEG2PNG_ALGORITHM_VERSION "6"
 static const float default_weight = 0.3;
 static const float default_pweight = 0.001;
 static const unsigned default_iterations = 50;
@@ -48,6 +59,8 @@ noreturn static void usage() {
                 "\ta value of 1.0 means equivalent weight to the first order weight\n"
                 "\ta value of 0.0 means plain Total Variation, and gives a speed boost\n"
                 "\tweights for the chroma components always default to 0.\n"
+                "\tthe M and Y components of CMYK default to the first weight, like C\n"
+                "\ta fourth weight is for the K component of CMYK, and defaults to the first\n"
                 "\tdefault value: %g\n"
                 "\n", default_weight);
         printf(
@@ -58,6 +71,7 @@ noreturn static void usage() {
                 "\ta value of 1.0 means about equivalent weight to the first order weight\n"
                 "\ta value of 0.0 means to ignore this and gives a speed boost\n"
                 "\tweights for the chroma components default to the luma weight\n"
+                "\ta fourth weight is for the K component of CMYK, and defaults to the first\n"
                 "\tdefault value: %g\n"
                 "\n", default_pweight);
         printf(
@@ -66,8 +80,16 @@ noreturn static void usage() {
                 "\titerations is an integer for the number of optimization steps\n"
                 "\thigher values give better results but take more time\n"
                 "\titerations for the chroma components default to the luma iterations\n"
+                "\ta fourth count is for the K component of CMYK, and defaults to the first\n"
                 "\tdefault value: %d\n"
                 "\n", default_iterations);
+        printf(
+                "-I\n"
+                "--auto-iterations\n"
+                "\tchoose the iterations for each file from its quantization tables\n"
+                "\tlightly compressed files get fewer iterations, heavily compressed ones more\n"
+                "\twith separated components, each component gets its own count\n"
+                "\n");
         printf(
                 "-q\n"
                 "--quiet\n"
@@ -80,6 +102,19 @@ noreturn static void usage() {
                 "\tthis is faster and makes multithreading more effective\n"
                 "\thowever the edges of different components can be different\n"
                 "\n");
+        printf(
+                "-n\n"
+                "--native-chroma\n"
+                "\toptimize subsampled chroma components at their own resolution\n"
+                "\tthis is faster, about twice for the common 4:2:0 subsampling\n"
+                "\tthe chroma components are upsampled only for the output\n"
+                "\n");
+        printf(
+                "-a\n"
+                "--adaptive\n"
+                "\trestart the momentum when the objective increases, and take smaller steps when it keeps increasing\n"
+                "\tthis often reaches the same result in fewer iterations\n"
+                "\n");
         printf(
                 "-t threads\n"
                 "--threads threads\n"
@@ -91,11 +126,19 @@ noreturn static void usage() {
                 "\tequivalent to setting the environment variable OMP_NUM_THREADS\n"
                 "\tdefault: number of CPUs\n"
                 "\n");
+        printf(
+                "-b\n"
+                "--bind-threads\n"
+                "\tbind each thread to its own CPU, spread over all CPUs\n"
+                "\teach file's buffers are then allocated on the NUMA node of its thread\n"
+                "\tthis helps on hosts with several sockets when decoding many files\n"
+                "\n");
         printf(
                 "-1\n"
                 "--16-bits-png\n"
                 "\toutput PNG with 16 bits color depth instead of the usual 8 bits\n"
                 "\tyou should use a high number of iterations when using this option\n"
+                "\twithout it, components quantized finer than 8 bits are left as decoded\n"
                 "\n");
         printf(
                 "-c csv_log\n"
@@ -103,6 +146,73 @@ noreturn static void usage() {
                 "\tcsv_log is a file name for the optimization log\n"
                 "\tdefault: none\n"
                 "\n");
+        printf(
+                "-T size\n"
+                "--tiles size\n"
+                "\toptimize the picture in tiles of size by size pixels, with a small border each\n"
+                "\tthis is faster for big pictures when the tiles fit in the CPU cache, try 256\n"
+                "\tand lets threads work on different tiles of a single picture\n"
+                "\tthe edges of tiles can be a little different from optimizing the whole picture\n"
+                "\tnot possible together with seed files, checkpoints or previews\n"
+                "\tdefault: the whole picture at once\n"
+                "\n");
+        printf(
+                "-x x,y,w,h\n"
+                "--crop x,y,w,h\n"
+                "\tonly decode the rectangle of w by h pixels with its top left corner at x,y\n"
+                "\tonly the blocks of the rectangle and a small border around it are optimized\n"
+                "\tdefault: the whole picture\n"
+                "\n");
+        printf(
+                "-S picture.png\n"
+                "--seed picture.png\n"
+                "\tpicture.png is an earlier output for the same JPEG, to continue optimizing from\n"
+                "\tthe given iterations are done in addition to those of the earlier run\n"
+                "\tits step sizes and momentum continue, as the earlier run recorded its iterations in its output\n"
+                "\tuse -1 for the earlier run, 8 bits PNG lose most of the progress\n"
+                "\tmust be specified either zero times or once for every input file\n"
+                "\tonly for grayscale and YCbCr pictures\n"
+                "\tdefault: none\n"
+                "\n");
+        printf(
+                "-z width[xheight][,width[xheight]...]\n"
+                "--thumbnails width[xheight][,width[xheight]...]\n"
+                "\talso write the result scaled down to each of these sizes, as picture_WxH.png\n"
+                "\tthe height is proportional to the width if not given\n"
+                "\tsizes larger than the picture are reduced to fit, keeping their aspect ratio\n"
+                "\tthe scaling is done before color conversion, by area averaging\n"
+                "\tnot possible when using a cache\n"
+                "\tdefault: none\n"
+                "\n");
+        printf(
+                "-P iterations[,iterations...]\n"
+                "--preview iterations[,iterations...]\n"
+                "\tafter each of the given numbers of iterations write a small 8 bits preview\n"
+                "\tto picture.png.preview.png, replacing the previous one\n"
+                "\tthe preview is removed when the output file is written\n"
+                "\tnot possible when using separated components\n"
+                "\tdefault: none\n"
+                "\n");
+        printf(
+                "-C cache_directory\n"
+                "--cache cache_directory\n"
+                "\tcache_directory is an existing directory for caching results\n"
+                "\tfiles with the same DCT coefficients and options are not decoded again\n"
+                "\tdefault: none\n"
+                "\n");
+        printf(
+                "-k interval\n"
+                "--checkpoint interval\n"
+                "\tinterval is a positive integer, every interval iterations the optimization state\n"
+                "\tis saved next to the output file, as picture.png.checkpoint\n"
+                "\tthe checkpoint is removed when the output file is written\n"
+                "\tdefault: no checkpoints\n"
+                "\n");
+        printf(
+                "-r\n"
+                "--resume\n"
+                "\tcontinue from the checkpoints of an interrupted run with the same options\n"
+                "\n");
         printf(
                 "-h\n"
                 "--help\n"
@@ -116,20 +226,137 @@ noreturn static void usage() {
         exit(EXIT_FAILURE);
 }
 
-// decode a single JPEG file smoothly
-void decode_file(const char* infile, const char *outfile, unsigned iterations[3], float weights[3], float pweights[3], unsigned png_bits, bool all_together, struct progressbar *pb, struct logger *plog) {
-        // decode jpg normally
-        FILE *in = fopen(infile, "rb");
-        if(!in) { die_perror("could not open input file `%s`", infile); }
-        struct jpeg jpeg;
-        read_jpeg(in, &jpeg);
-        fclose(in);
-        for(unsigned c = 0; c < 3; c++) {
-                struct coef *coef = &jpeg.coefs[c];
-                decode_coefficients(coef);
+// requested size of an additional scaled down output
+// h is 0 to keep the aspect ratio
+struct thumbnail {
+        unsigned w;
+        unsigned h;
+};
+
+// settings from the command line, the same for every picture
+struct options {
+        unsigned iterations[MAX_NCOMPONENT];
+        // iterations are chosen per picture from its quantization tables
+        bool auto_budget;
+        float weights[MAX_NCOMPONENT];
+        // weights[1] and weights[2] were given, otherwise they are chosen per picture by its color space
+        bool component_weights;
+        float pweights[MAX_NCOMPONENT];
+        unsigned png_bits;
+        bool all_together;
+        bool native_chroma;
+        bool adaptive;
+        // 0 for the whole picture at once
+        unsigned tile;
+        bool cropped;
+        struct crop crop;
+        // NULL without a cache
+        const char *cache_dir;
+        unsigned checkpoint_interval;
+        bool resume;
+        unsigned preview_iterations[16];
+        unsigned npreview;
+        struct thumbnail thumbnails[16];
+        unsigned nthumbnail;
+};
+
+// hash of everything that determines the output for a jpeg decoded with these options
+// crop is the crop as applied to the jpeg, or NULL
+static void hash_job(unsigned char digest[32], struct jpeg *jpeg, const struct options *opt, float *seed[], const unsigned seed_iterations[], size_t seed_size, struct crop *crop) {
+        struct sha256 hash;
+        sha256_start(&hash);
+        const char *version = "jpeg2png " JPEG2PNG_VERSION " algorithm " JPEG2PNG_ALGORITHM_VERSION
+#ifdef USE_F16C
+                " f16c"
+#endif
+                ;
+        sha256_update(&hash, version, strlen(version) + 1);
+        // options
+        sha256_update(&hash, opt->iterations, sizeof(*opt->iterations) * MAX_NCOMPONENT);
+        sha256_update(&hash, opt->weights, sizeof(*opt->weights) * MAX_NCOMPONENT);
+        sha256_update(&hash, opt->pweights, sizeof(*opt->pweights) * MAX_NCOMPONENT);
+        sha256_update(&hash, &opt->png_bits, sizeof(opt->png_bits));
+        sha256_update(&hash, &opt->all_together, sizeof(opt->all_together));
+        sha256_update(&hash, &opt->native_chroma, sizeof(opt->native_chroma));
+        sha256_update(&hash, &opt->adaptive, sizeof(opt->adaptive));
+        sha256_update(&hash, &opt->tile, sizeof(opt->tile));
+        if(crop) {
+                unsigned rect[4] = {crop->x, crop->y, crop->w, crop->h};
+                sha256_update(&hash, rect, sizeof(rect));
+        }
+        // jpeg
+        unsigned header[5] = {jpeg->w, jpeg->h, jpeg->color, jpeg->inverted, jpeg->ncomponent};
+        sha256_update(&hash, header, sizeof(header));
+        for(unsigned c = 0; c < jpeg->ncomponent; c++) {
+                struct coef *coef = &jpeg->coefs[c];
+                unsigned size[4] = {coef->w, coef->h, coef->w_samp, coef->h_samp};
+                sha256_update(&hash, size, sizeof(size));
+                sha256_update(&hash, coef->quant_table, sizeof(coef->quant_table));
+                sha256_update(&hash, coef->data, sizeof(*coef->data) * coef->w * coef->h);
+                if(seed) {
+                        sha256_update(&hash, seed[c], sizeof(*seed[c]) * seed_size);
+                        sha256_update(&hash, &seed_iterations[c], sizeof(seed_iterations[c]));
+                }
+        }
+        sha256_finish(&hash, digest);
+}
+
+// checkpoint file for compute() on the given channel, or on all channels together
+static void checkpoint_init(struct checkpoint *checkpoint, const char *outfile, unsigned channel, bool all_together, unsigned interval, bool resume, const unsigned char key[32]) {
+        size_t l = strlen(outfile) + 64;
+        checkpoint->filename = malloc(l);
+        if(!checkpoint->filename) { die("could not allocate checkpoint file name"); }
+        if(all_together) {
+                snprintf(checkpoint->filename, l, "%s.checkpoint", outfile);
+        } else {
+                snprintf(checkpoint->filename, l, "%s.%u.checkpoint", outfile, channel);
         }
-        for(unsigned i = 0; i < 3; i++) {
-                struct coef *coef = &jpeg.coefs[i];
+        checkpoint->interval = interval;
+        checkpoint->resume = resume;
+        memcpy(checkpoint->key, key, sizeof(checkpoint->key));
+}
+
+// scale the result down and write it as picture_WxH.png next to the output
+// sizes larger than the picture are reduced to fit, keeping their aspect ratio
+// the planes of the result must be full size
+static void write_thumbnail(struct jpeg *jpeg, const char *outfile, const struct thumbnail *thumbnail, unsigned png_bits) {
+        unsigned w = MIN(thumbnail->w, jpeg->w);
+        unsigned h = MAX((unsigned)((double)jpeg->h * w / jpeg->w + 0.5), 1);
+        if(thumbnail->h) {
+                double scale = MIN(1., MIN((double)jpeg->w / thumbnail->w, (double)jpeg->h / thumbnail->h));
+                w = MIN(MAX((unsigned)(thumbnail->w * scale + 0.5), 1), jpeg->w);
+                h = MIN(MAX((unsigned)(thumbnail->h * scale + 0.5), 1), jpeg->h);
+        }
+        struct jpeg small = *jpeg;
+        small.w = w;
+        small.h = h;
+        for(unsigned c = 0; c < jpeg->ncomponent; c++) {
+                struct coef *coef = &jpeg->coefs[c];
+                small.coefs[c].fdata = downscale(coef->fdata, coef->w, jpeg->w, jpeg->h, w, h);
+                small.coefs[c].w = w;
+                small.coefs[c].h = h;
+        }
+        size_t l = strlen(outfile);
+        if(l >= 4 && memcmp(".png", &outfile[l-4], 4) == 0) {
+                l -= 4;
+        }
+        char *filename = malloc(l + 64);
+        if(!filename) { die("could not allocate thumbnail file name"); }
+        snprintf(filename, l + 64, "%.*s_%ux%u.png", (int)l, outfile, w, h);
+        struct output out;
+        write_png(output_open(filename, &out), png_bits, &small, NULL);
+        output_close(&out);
+        free(filename);
+        for(unsigned c = 0; c < jpeg->ncomponent; c++) {
+                free_real(small.coefs[c].fdata);
+        }
+}
+
+// decode the DCT coefficients of all components to planes in normal order
+static void decode_planes(struct jpeg *jpeg) {
+        for(unsigned c = 0; c < jpeg->ncomponent; c++) {
+                struct coef *coef = &jpeg->coefs[c];
+                decode_coefficients(coef);
                 float *temp = alloc_real(coef->h * coef->w);
 
                 unbox(coef->fdata, temp, coef->w, coef->h);
@@ -137,40 +364,341 @@ void decode_file(const char* infile, const char *outfile, unsigned iterations[3]
                 free_real(coef->fdata);
                 coef->fdata = temp;
         }
+}
 
-        // smooth
-        if(all_together) {
-                plog->channel = 3;
-                compute(3, jpeg.coefs, plog, pb, weights[0], pweights, iterations[0]);
+// whether component c is left as decoded, because its quantization is finer than the output
+// it must be optimized at full resolution, otherwise the optimization also upsamples it
+// components optimized together are only left when all of them can be
+static bool bypassed(struct jpeg *jpeg, unsigned c, const struct options *opt) {
+        for(unsigned i = 0; i < jpeg->ncomponent; i++) {
+                if(!opt->all_together && i != c) {
+                        continue;
+                }
+                struct coef *coef = &jpeg->coefs[i];
+                bool full = coef->w_samp == 1 && coef->h_samp == 1;
+                if(!(full || opt->native_chroma) || !trivial_quantization(coef, opt->png_bits)) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+// optimize the decoded planes, all components together or each separately
+// checkpoints, seed and preview can be NULL
+// seed_iterations are the iterations of the run that produced the seed, for each component
+static void smooth(struct jpeg *jpeg, const struct options *opt, struct checkpoint *checkpoints, float *seed[], const unsigned seed_iterations[], struct preview *preview, struct progressbar *pb, struct logger *plog) {
+        unsigned ncomponent = jpeg->ncomponent;
+        if(opt->all_together) {
+                if(bypassed(jpeg, 0, opt)) {
+                        return;
+                }
+                struct logger log = *plog;
+                log.channel = ncomponent;
+                compute(ncomponent, jpeg->coefs, &log, pb, opt->weights[0], opt->pweights, opt->iterations[0], opt->native_chroma, opt->adaptive, checkpoints, seed, seed ? seed_iterations[0] : 0, preview);
         } else {
                 struct logger log = *plog;
                 OPENMP(parallel for schedule(dynamic) firstprivate(log))
-                for(unsigned i = 0; i < 3; i++) {
+                for(unsigned i = 0; i < ncomponent; i++) {
+                        if(bypassed(jpeg, i, opt)) {
+                                continue;
+                        }
                         log.channel = i;
-                        struct coef *coef = &jpeg.coefs[i];
-                        compute(1, coef, &log, pb, weights[i], &pweights[i], iterations[i]);
+                        struct coef *coef = &jpeg->coefs[i];
+                        compute(1, coef, &log, pb, opt->weights[i], &opt->pweights[i], opt->iterations[i], opt->native_chroma, opt->adaptive, checkpoints ? &checkpoints[i] : NULL, seed ? &seed[i] : NULL, seed ? seed_iterations[i] : 0, NULL);
                 }
         }
+}
 
-        // fixup luma range
-        struct coef *coef = &jpeg.coefs[0];
-        for(unsigned i = 0; i < coef->h * coef->w; i++) {
-                coef->fdata[i] += 128.;
+// upsample components that were optimized at native resolution
+static void upsample_planes(struct jpeg *jpeg) {
+        unsigned w = 0;
+        unsigned h = 0;
+        for(unsigned i = 0; i < jpeg->ncomponent; i++) {
+                struct coef *coef = &jpeg->coefs[i];
+                w = MAX(w, coef->w * coef->w_samp);
+                h = MAX(h, coef->h * coef->h_samp);
+        }
+        for(unsigned i = 0; i < jpeg->ncomponent; i++) {
+                struct coef *coef = &jpeg->coefs[i];
+                if(coef->w_samp > 1 || coef->h_samp > 1) {
+                        float *temp = upsample(coef->fdata, coef->w, coef->h, coef->w_samp, coef->h_samp, w, h);
+                        free_real(coef->fdata);
+                        coef->fdata = temp;
+                        coef->w = w;
+                        coef->h = h;
+                        coef->w_samp = 1;
+                        coef->h_samp = 1;
+                }
+        }
+}
+
+// optimize the picture in overlapping tiles of tile x tile pixels, instead of all at once
+// the working set of a tile fits in the cache, so all iterations of a tile run from the cache
+// each tile is optimized with a border around it, like a crop, and only its inside is kept
+// the planes of the result are full size
+static void smooth_tiled(struct jpeg *jpeg, const struct options *opt, struct progressbar *pb, struct logger *plog) {
+        unsigned tile = opt->tile;
+        unsigned w = jpeg->w;
+        unsigned h = jpeg->h;
+        float *planes[MAX_NCOMPONENT];
+        for(unsigned c = 0; c < jpeg->ncomponent; c++) {
+                planes[c] = alloc_real(w * h);
+        }
+        unsigned ntile_x = (w + tile - 1) / tile;
+        unsigned ntile_y = (h + tile - 1) / tile;
+        OPENMP(parallel for schedule(dynamic))
+        for(unsigned i = 0; i < ntile_x * ntile_y; i++) {
+                unsigned x = (i % ntile_x) * tile;
+                unsigned y = (i / ntile_x) * tile;
+                struct crop rect = {x, y, MIN(tile, w - x), MIN(tile, h - y)};
+                struct jpeg part;
+                crop_copy(jpeg, &rect, &part);
+                decode_planes(&part);
+                smooth(&part, opt, NULL, NULL, NULL, NULL, pb, plog);
+                upsample_planes(&part);
+                crop_planes(&part, &rect);
+                for(unsigned c = 0; c < part.ncomponent; c++) {
+                        for(unsigned ty = 0; ty < rect.h; ty++) {
+                                memcpy(&planes[c][(y + ty) * w + x], &part.coefs[c].fdata[ty * rect.w], sizeof(float) * rect.w);
+                        }
+                        free_real(part.coefs[c].fdata);
+                        free(part.coefs[c].data);
+                }
+        }
+        for(unsigned c = 0; c < jpeg->ncomponent; c++) {
+                struct coef *coef = &jpeg->coefs[c];
+                coef->fdata = planes[c];
+                coef->w = w;
+                coef->h = h;
+                coef->w_samp = 1;
+                coef->h_samp = 1;
+        }
+}
+
+// decode a single JPEG file smoothly
+// returns whether the result came from the cache
+// seedfile can be NULL
+static bool decode_file(struct input *in, const char *outfile, const char *seedfile, const struct options *options, struct progressbar *pb, struct logger *plog) {
+        // decode jpg normally
+        struct jpeg jpeg;
+        read_jpeg(in, &jpeg);
+        struct crop rect;
+        if(options->cropped) {
+                rect = options->crop;
+                crop_jpeg(&jpeg, &rect);
+        }
+        // the options for this picture, with its own iterations
+        struct options picture_options = *options;
+        const struct options *opt = &picture_options;
+        if(opt->auto_budget) {
+                auto_iterations(&jpeg, opt->all_together, picture_options.iterations);
+        }
+        if(!opt->component_weights) {
+                // chroma defaults to weight 0, the other components like C, M and Y of CMYK to the first weight
+                bool ycc = jpeg.color == COLOR_YCBCR || jpeg.color == COLOR_YCCK;
+                picture_options.weights[1] = ycc ? 0. : opt->weights[0];
+                picture_options.weights[2] = picture_options.weights[1];
         }
 
-        // write png
-        FILE *out = fopen(outfile, "wb");
-        if(!out) { die_perror("could not open output file `%s`", outfile); }
-        write_png(out, jpeg.w, jpeg.h, png_bits, &jpeg.coefs[0], &jpeg.coefs[1], &jpeg.coefs[2]);
-        fclose(out);
+        // read the earlier result to continue from
+        float *seed[MAX_NCOMPONENT];
+        unsigned seed_iterations[MAX_NCOMPONENT];
+        size_t seed_size = 0;
+        if(seedfile) {
+                unsigned w = 0;
+                unsigned h = 0;
+                for(unsigned c = 0; c < jpeg.ncomponent; c++) {
+                        struct coef *coef = &jpeg.coefs[c];
+                        w = MAX(w, coef->w * coef->w_samp);
+                        h = MAX(h, coef->h * coef->h_samp);
+                }
+                FILE *f = fopen(seedfile, "rb");
+                if(!f) { die_perror("could not open `%s`", seedfile); }
+                read_png(f, seedfile, &jpeg, w, h, seed, seed_iterations);
+                fclose(f);
+                seed_size = (size_t)w * h;
+        }
+
+        unsigned char digest[32];
+        bool checkpointing = opt->checkpoint_interval || opt->resume;
+        if(opt->cache_dir || checkpointing) {
+                hash_job(digest, &jpeg, opt, seedfile ? seed : NULL, seed_iterations, seed_size, opt->cropped ? &rect : NULL);
+        }
+
+        // use cached result if possible
+        char *cache_file = NULL;
+        if(opt->cache_dir) {
+                cache_file = cache_filename(opt->cache_dir, digest);
+                if(cache_fetch(cache_file, outfile)) {
+                        free(cache_file);
+                        for(unsigned i = 0; i < jpeg.ncomponent; i++) {
+                                free(jpeg.coefs[i].data);
+                                if(seedfile) {
+                                        free_real(seed[i]);
+                                }
+                        }
+                        return true;
+                }
+        }
+        unsigned ncomponent = jpeg.ncomponent;
+        struct checkpoint checkpoints[MAX_NCOMPONENT];
+        if(checkpointing) {
+                for(unsigned c = 0; c < (opt->all_together ? 1 : ncomponent); c++) {
+                        checkpoint_init(&checkpoints[c], outfile, c, opt->all_together, opt->checkpoint_interval, opt->resume, digest);
+                }
+        }
+
+        struct preview preview;
+        if(opt->npreview) {
+                size_t l = strlen(outfile) + 64;
+                preview.filename = malloc(l);
+                if(!preview.filename) { die("could not allocate preview file name"); }
+                snprintf(preview.filename, l, "%s.preview.png", outfile);
+                preview.iterations = opt->preview_iterations;
+                preview.niteration = opt->npreview;
+                preview.jpeg = &jpeg;
+        }
+
+        // the iterations that produced each component of the result, recorded in the output to continue from
+        unsigned done[MAX_NCOMPONENT];
+        for(unsigned c = 0; c < ncomponent; c++) {
+                unsigned k = opt->all_together ? 0 : c;
+                done[c] = seedfile ? seed_iterations[k] : 0;
+                if(!bypassed(&jpeg, c, opt)) {
+                        done[c] += opt->iterations[k];
+                }
+        }
+
+        // smooth
+        if(opt->tile) {
+                smooth_tiled(&jpeg, opt, pb, plog);
+        } else {
+                decode_planes(&jpeg);
+                smooth(&jpeg, opt, checkpointing ? checkpoints : NULL, seedfile ? seed : NULL, seed_iterations, opt->npreview ? &preview : NULL, pb, plog);
+                upsample_planes(&jpeg);
+        }
+        if(seedfile) {
+                for(unsigned c = 0; c < ncomponent; c++) {
+                        free_real(seed[c]);
+                }
+        }
+
+        if(opt->cropped) {
+                crop_planes(&jpeg, &rect);
+        }
+
+        // fixup range of luma and other components that are not chroma
+        for(unsigned c = 0; c < ncomponent; c++) {
+                bool chroma = (jpeg.color == COLOR_YCBCR || jpeg.color == COLOR_YCCK) && (c == 1 || c == 2);
+                if(chroma) {
+                        continue;
+                }
+                struct coef *coef = &jpeg.coefs[c];
+                for(unsigned i = 0; i < coef->h * coef->w; i++) {
+                        coef->fdata[i] += 128.;
+                }
+        }
+
+        // scaled down outputs, from the planes before color conversion
+        for(unsigned i = 0; i < opt->nthumbnail; i++) {
+                write_thumbnail(&jpeg, outfile, &opt->thumbnails[i], opt->png_bits);
+        }
+
+        // write png, through the cache if used
+        struct output out;
+        write_png(output_open(cache_file ? cache_file : outfile, &out), opt->png_bits, &jpeg, done);
+        output_close(&out);
+        if(cache_file) {
+                if(!cache_fetch(cache_file, outfile)) {
+                        die_perror("could not open cached file `%s`", cache_file);
+                }
+                free(cache_file);
+        }
+
+        // the result is written, so the previews and checkpoints are no longer needed
+        if(opt->npreview) {
+                preview_remove(&preview);
+                free(preview.filename);
+        }
+        if(checkpointing) {
+                for(unsigned c = 0; c < (opt->all_together ? 1 : ncomponent); c++) {
+                        checkpoint_remove(&checkpoints[c]);
+                        free(checkpoints[c].filename);
+                }
+        }
 
         // clean up
-        for(unsigned i = 0; i < 3; i++) {
+        for(unsigned i = 0; i < ncomponent; i++) {
                 free_real(jpeg.coefs[i].fdata);
                 free(jpeg.coefs[i].data);
         }
+        return false;
+}
+
+// the work of smooth() for a picture, in the units of estimate_cost
+static unsigned long long smooth_cost(struct jpeg *jpeg, const struct options *opt) {
+        if(opt->all_together) {
+                if(bypassed(jpeg, 0, opt)) {
+                        return 0;
+                }
+                return compute_blocks(jpeg->ncomponent, jpeg->coefs, opt->native_chroma) * opt->iterations[0];
+        }
+        // each component is optimized on its own plane, upsampled only to its own size
+        unsigned long long cost = 0;
+        for(unsigned c = 0; c < jpeg->ncomponent; c++) {
+                if(bypassed(jpeg, c, opt)) {
+                        continue;
+                }
+                cost += compute_blocks(1, &jpeg->coefs[c], opt->native_chroma) * opt->iterations[c];
+        }
+        return cost;
+}
+
+// estimate the work of decode_file from the JPEG header only
+// in units of 8x8 blocks per channel per iteration, the same units compute() reports progress in
+static unsigned long long estimate_cost(struct input *in, const struct options *options) {
+        struct jpeg jpeg;
+        read_jpeg_header(in, &jpeg);
+        if(options->cropped) {
+                struct crop rect = options->crop;
+                crop_jpeg(&jpeg, &rect);
+        }
+        struct options picture_options = *options;
+        const struct options *opt = &picture_options;
+        if(opt->auto_budget) {
+                auto_iterations(&jpeg, opt->all_together, picture_options.iterations);
+        }
+        unsigned tile = opt->tile;
+        if(!tile) {
+                return smooth_cost(&jpeg, opt);
+        }
+        // tiles overlap, so they cost more than the whole picture
+        unsigned long long cost = 0;
+        for(unsigned y = 0; y < jpeg.h; y += tile) {
+                for(unsigned x = 0; x < jpeg.w; x += tile) {
+                        struct crop rect = {x, y, MIN(tile, jpeg.w - x), MIN(tile, jpeg.h - y)};
+                        struct jpeg part;
+                        crop_copy(&jpeg, &rect, &part);
+                        cost += smooth_cost(&part, opt);
+                }
+        }
+        return cost;
 }
 
+struct job {
+        unsigned long long cost;
+        unsigned index;
+};
+
+// sort jobs by decreasing cost, keeping command line order for equal costs
+static int job_compare(const void *a, const void *b) {
+        const struct job *ja = a;
+        const struct job *jb = b;
+        if(ja->cost != jb->cost) {
+                return ja->cost < jb->cost ? 1 : -1;
+        }
+        return ja->index < jb->index ? -1 : ja->index > jb->index;
+}
 
 struct progressbar *main_progressbar;
 
@@ -184,11 +712,23 @@ int main(int argc, const char **argv) {
                 gopt_option('o', GOPT_ARG | GOPT_REPEAT, gopt_shorts('o'), gopt_longs("output")),
                 gopt_option('f', GOPT_NOARG, gopt_shorts('f'), gopt_longs("force")),
                 gopt_option('c', GOPT_ARG, gopt_shorts('c'), gopt_longs("csv-log")),
+                gopt_option('T', GOPT_ARG, gopt_shorts('T'), gopt_longs("tiles")),
+                gopt_option('x', GOPT_ARG, gopt_shorts('x'), gopt_longs("crop")),
+                gopt_option('S', GOPT_ARG | GOPT_REPEAT, gopt_shorts('S'), gopt_longs("seed")),
+                gopt_option('z', GOPT_ARG, gopt_shorts('z'), gopt_longs("thumbnails")),
+                gopt_option('P', GOPT_ARG, gopt_shorts('P'), gopt_longs("preview")),
+                gopt_option('C', GOPT_ARG, gopt_shorts('C'), gopt_longs("cache")),
+                gopt_option('k', GOPT_ARG, gopt_shorts('k'), gopt_longs("checkpoint")),
+                gopt_option('r', GOPT_NOARG, gopt_shorts('r'), gopt_longs("resume")),
                 gopt_option('t', GOPT_ARG, gopt_shorts('t'), gopt_longs("threads")),
+                gopt_option('b', GOPT_NOARG, gopt_shorts('b'), gopt_longs("bind-threads")),
                 gopt_option('q', GOPT_NOARG, gopt_shorts('q'), gopt_longs("quiet")),
                 gopt_option('s', GOPT_NOARG, gopt_shorts('s'), gopt_longs("separate-components")),
+                gopt_option('n', GOPT_NOARG, gopt_shorts('n'), gopt_longs("native-chroma")),
+                gopt_option('a', GOPT_NOARG, gopt_shorts('a'), gopt_longs("adaptive")),
                 gopt_option('1', GOPT_NOARG, gopt_shorts('1'), gopt_longs("16-bits-png")),
                 gopt_option('i', GOPT_ARG, gopt_shorts('i'), gopt_longs("iterations")),
+                gopt_option('I', GOPT_NOARG, gopt_shorts('I'), gopt_longs("auto-iterations")),
                 gopt_option('p', GOPT_ARG, gopt_shorts('p'), gopt_longs("probability-weight")),
                 gopt_option('w', GOPT_ARG, gopt_shorts('w'), gopt_longs("second-order-weight"))));
         // parse command line flags
@@ -200,48 +740,76 @@ int main(int argc, const char **argv) {
                 usage();
         }
 
-        bool all_together = ! gopt(options, 's');
+        struct options opt;
+        memset(&opt, 0, sizeof(opt));
+        opt.all_together = ! gopt(options, 's');
+        opt.native_chroma = gopt(options, 'n');
+        opt.adaptive = gopt(options, 'a');
 
         const char *arg_string;
-        float weights[3] = {default_weight, 0., 0.};
+        // the fourth component is K of CMYK, it defaults to the weights of the first component
+        float *weights = opt.weights;
+        weights[0] = default_weight;
+        weights[3] = default_weight;
         if(gopt_arg(options, 'w', &arg_string)) {
-                int n = sscanf(arg_string, "%f,%f,%f", &weights[0], &weights[1], &weights[2]);
-                if(n == 3) {
-                        if(all_together) {
+                int n = sscanf(arg_string, "%f,%f,%f,%f", &weights[0], &weights[1], &weights[2], &weights[3]);
+                if(n == 3 || n == 4) {
+                        if(opt.all_together) {
                                 die("different weights are only possible when using separated components");
                         }
+                        if(n == 3) {
+                                weights[3] = weights[0];
+                        }
+                        opt.component_weights = true;
                 } else if(n ==1) {
-                        // ok
+                        weights[3] = weights[0];
                 } else {
                         die("invalid weight");
                 }
         }
-        float pweights[3] = {default_pweight, default_pweight, default_pweight};
+        float *pweights = opt.pweights;
+        for(unsigned c = 0; c < MAX_NCOMPONENT; c++) {
+                pweights[c] = default_pweight;
+        }
         if(gopt_arg(options, 'p', &arg_string)) {
-                int n = sscanf(arg_string, "%f,%f,%f", &pweights[0], &pweights[1], &pweights[2]);
-                if(n == 3) {
+                int n = sscanf(arg_string, "%f,%f,%f,%f", &pweights[0], &pweights[1], &pweights[2], &pweights[3]);
+                if(n == 4) {
                         // ok
+                } else if(n == 3) {
+                        pweights[3] = pweights[0];
                 } else if(n == 1) {
                         pweights[1] = pweights[0];
                         pweights[2] = pweights[0];
+                        pweights[3] = pweights[0];
                 } else {
                         die("invalid probability weight");
                 }
         }
-        unsigned iterations[3] = {default_iterations, default_iterations, default_iterations};
+        unsigned *iterations = opt.iterations;
+        for(unsigned c = 0; c < MAX_NCOMPONENT; c++) {
+                iterations[c] = default_iterations;
+        }
         if(gopt_arg(options, 'i', &arg_string)) {
-                int n = sscanf(arg_string, "%u,%u,%u", &iterations[0], &iterations[1], &iterations[2]);
-                if(n == 3) {
-                        if(all_together) {
+                int n = sscanf(arg_string, "%u,%u,%u,%u", &iterations[0], &iterations[1], &iterations[2], &iterations[3]);
+                if(n == 3 || n == 4) {
+                        if(opt.all_together) {
                                 die("different iteration counts are only possible when using separated components");
                         }
+                        if(n == 3) {
+                                iterations[3] = iterations[0];
+                        }
                 } else if(n == 1) {
                         iterations[1] = iterations[0];
                         iterations[2] = iterations[0];
+                        iterations[3] = iterations[0];
                 } else {
                         die("invalid number of iterations");
                 }
         }
+        opt.auto_budget = gopt(options, 'I');
+        if(opt.auto_budget && gopt(options, 'i')) {
+                die("iterations can not be given with automatic iterations");
+        }
 
         if(gopt_arg(options, 't', &arg_string)) {
 #ifdef _OPENMP
@@ -255,6 +823,9 @@ int main(int argc, const char **argv) {
                 die("this version is compiled without support for threads");
 #endif
         }
+        if(gopt(options, 'b')) {
+                bind_threads();
+        }
 
         FILE *csv_log = NULL;
         if(gopt_arg(options, 'c', &arg_string)) {
@@ -263,8 +834,92 @@ int main(int argc, const char **argv) {
         }
 
         bool quiet = gopt(options, 'q');
-        unsigned png_bits = gopt(options, '1') ? 16 : 8;
+        opt.png_bits = gopt(options, '1') ? 16 : 8;
         bool force = gopt(options, 'f');
+        opt.cache_dir = NULL;
+        gopt_arg(options, 'C', &opt.cache_dir);
+        if(gopt_arg(options, 'k', &arg_string)) {
+                int n = sscanf(arg_string, "%u", &opt.checkpoint_interval);
+                if(n != 1 || opt.checkpoint_interval == 0) {
+                        die("invalid checkpoint interval");
+                }
+        }
+        opt.resume = gopt(options, 'r');
+        struct thumbnail *thumbnails = opt.thumbnails;
+        unsigned nthumbnail = 0;
+        if(gopt_arg(options, 'z', &arg_string)) {
+                if(opt.cache_dir) {
+                        die("thumbnails can not be used with a cache");
+                }
+                const char *s = arg_string;
+                while(true) {
+                        if(nthumbnail == sizeof(opt.thumbnails) / sizeof(*opt.thumbnails)) {
+                                die("too many thumbnails");
+                        }
+                        struct thumbnail *t = &thumbnails[nthumbnail];
+                        int l;
+                        t->h = 0;
+                        if(sscanf(s, "%ux%u%n", &t->w, &t->h, &l) == 2) {
+                                if(t->h == 0) {
+                                        die("invalid thumbnail size");
+                                }
+                        } else if(sscanf(s, "%u%n", &t->w, &l) != 1) {
+                                die("invalid thumbnail size");
+                        }
+                        if(t->w == 0) {
+                                die("invalid thumbnail size");
+                        }
+                        nthumbnail++;
+                        s += l;
+                        if(*s == '\0') {
+                                break;
+                        } else if(*s != ',') {
+                                die("invalid thumbnail size");
+                        }
+                        s++;
+                }
+        }
+        opt.nthumbnail = nthumbnail;
+        if(gopt_arg(options, 'T', &arg_string)) {
+                int n = sscanf(arg_string, "%u", &opt.tile);
+                if(n != 1 || opt.tile == 0) {
+                        die("invalid tile size");
+                }
+        }
+        if(gopt_arg(options, 'x', &arg_string)) {
+                struct crop *crop = &opt.crop;
+                int n = sscanf(arg_string, "%u,%u,%u,%u", &crop->x, &crop->y, &crop->w, &crop->h);
+                if(n != 4 || crop->w == 0 || crop->h == 0) {
+                        die("invalid crop");
+                }
+                opt.cropped = true;
+        }
+        unsigned *preview_iterations = opt.preview_iterations;
+        unsigned npreview = 0;
+        if(gopt_arg(options, 'P', &arg_string)) {
+                if(!opt.all_together) {
+                        die("previews are only possible when optimizing components together");
+                }
+                const char *s = arg_string;
+                while(true) {
+                        if(npreview == sizeof(opt.preview_iterations) / sizeof(*opt.preview_iterations)) {
+                                die("too many preview iterations");
+                        }
+                        int l;
+                        if(sscanf(s, "%u%n", &preview_iterations[npreview], &l) != 1) {
+                                die("invalid preview iterations");
+                        }
+                        npreview++;
+                        s += l;
+                        if(*s == '\0') {
+                                break;
+                        } else if(*s != ',') {
+                                die("invalid preview iterations");
+                        }
+                        s++;
+                }
+        }
+        opt.npreview = npreview;
 
         // initialize logger
         struct logger log;
@@ -277,6 +932,23 @@ int main(int argc, const char **argv) {
                 die("must give output file names for all input files or none");
         }
 
+        unsigned nseed = gopt(options, 'S');
+        if(!(nseed == 0 || nseed == nin)) {
+                die("must give seed file names for all input files or none");
+        }
+        if(nseed && opt.cropped) {
+                die("seed files can not be used with a crop");
+        }
+        if(opt.tile && (nseed || opt.checkpoint_interval || opt.resume || opt.npreview)) {
+                die("tiles can not be used with seed files, checkpoints or previews");
+        }
+        const char **seedfiles = NULL;
+        if(nseed) {
+                seedfiles = malloc(sizeof(*seedfiles) * nseed);
+                if(!seedfiles) { die("could not allocate seed file names"); }
+                gopt_args(options, 'S', seedfiles, nseed);
+        }
+
         char **outfiles = malloc(sizeof(*outfiles) * nin);
         if(!outfiles) { die("could not allocate outfiles"); }
         if(nout) {
@@ -284,10 +956,6 @@ int main(int argc, const char **argv) {
         } else {
                 for(unsigned i = 0; i < nin; i++) {
                         const char *infile = argv[1+i];
-                        FILE *in = fopen(infile, "rb");
-                        if(!in) { die("could not open input file `%s`", infile); }
-                        fclose(in);
-
                         unsigned l = strlen(infile);
                         unsigned e = l;
                         if(l >= 5 && memcmp(".jpeg", &infile[l-5], 5) == 0) {
@@ -305,46 +973,72 @@ int main(int argc, const char **argv) {
                                 FILE *out = fopen(outfile, "rb");
                                 if(out) { die("not overwriting output file `%s`", outfile); }
                         }
-
-                        FILE *out = fopen(outfile, "wb");
-                        if(!out) { die("could not open output file `%s`", outfile); }
-                        fclose(out);
-                        remove(outfile);
+                        output_check(outfile);
 
                         outfiles[i] = outfile;
                 }
         }
 
+        // estimate cost of each file, so the biggest files are started first
+        // otherwise a big file at the end keeps one thread busy while the others idle
+        // this also checks that all input files can be opened before doing any work
+        struct job *jobs = malloc(sizeof(*jobs) * nin);
+        struct input *inputs = malloc(sizeof(*inputs) * nin);
+        if(!jobs || !inputs) { die("could not allocate jobs"); }
+        unsigned long long total_cost = 0;
+        for(unsigned i = 0; i < nin; i++) {
+                input_open(argv[1+i], &inputs[i]);
+                jobs[i].cost = estimate_cost(&inputs[i], &opt);
+                // mapped files are cheap to map again, but pipes can be read only once, so keep those
+                if(inputs[i].mapped) {
+                        input_close(&inputs[i]);
+                }
+                jobs[i].index = i;
+                total_cost += jobs[i].cost;
+        }
+        qsort(jobs, nin, sizeof(*jobs), job_compare);
+
         // initialize progress bar
         struct progressbar pb;
         if(!quiet) {
-                if(all_together) {
-                        progressbar_start(&pb, nin * iterations[0]);
-                } else {
-                        progressbar_start(&pb, nin * (iterations[0] + iterations[1] + iterations[2]));
-                }
+                progressbar_start(&pb, MAX(total_cost, 1));
                 main_progressbar = &pb;
         }
 
         // decode each file smoothly
         OPENMP(parallel for schedule(dynamic) if(nin > 1) firstprivate(log))
         for(unsigned i = 0; i < nin; i++) {
-                const char *infile = argv[1+i];
-                const char *outfile = outfiles[i];
+                const char *infile = argv[1+jobs[i].index];
+                const char *outfile = outfiles[jobs[i].index];
                 log.filename = infile;
 
-                decode_file(infile, outfile, iterations, weights, pweights, png_bits, all_together, quiet ? NULL : &pb, &log);
+                struct input *in = &inputs[jobs[i].index];
+                if(!in->data) {
+                        input_open(infile, in);
+                }
+                const char *seedfile = nseed ? seedfiles[jobs[i].index] : NULL;
+                bool cached = decode_file(in, outfile, seedfile, &opt, quiet ? NULL : &pb, &log);
+                if(cached && !quiet) {
+                        OPENMP(critical(progressbar))
+                        progressbar_add(&pb, jobs[i].cost);
+                }
+                input_close(in);
         }
 
         // clean up
+        free(jobs);
+        free(inputs);
         if(!nout) {
                 for(unsigned i = 0; i < nin; i++) {
                         free(outfiles[i]);
                 }
         }
         free(outfiles);
+        free(seedfiles);
 
         if(!quiet) {
+                // the estimates must be exact, otherwise the progress bar stops short or runs over
+                assert(pb.current == total_cost);
                 progressbar_clear(&pb);
                 main_progressbar = NULL;
         }
@@ -19,6 +19,9 @@ struct coef {
         uint16_t quant_table[64];
 };
 
+// maximum number of components in a jpeg that we support, for CMYK
+#define MAX_NCOMPONENT 4
+
 extern struct progressbar *main_progressbar;
 
 #endif
@@ -0,0 +1,207 @@
+#ifndef _WIN32
+  #define _XOPEN_SOURCE 700
+  #include <sys/types.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <errno.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+#include "utils.h"
+
+// size of the write buffer, so that libpng's small writes become few large ones
+static const size_t output_buffer_size = 1 << 20;
+
+#ifndef _WIN32
+// create a new temporary file next to filename, so it can be renamed over it
+// st is the file it replaces, whose permissions and if allowed owner it gets, or NULL for a new file
+static FILE *open_temp(const char *filename, const struct stat *st, char **temp_filename) {
+        static unsigned counter = 0;
+        size_t l = strlen(filename) + 64;
+        char *name = malloc(l);
+        if(!name) { die("could not allocate output file name"); }
+        while(true) {
+                unsigned n;
+                OPENMP(atomic capture)
+                n = counter++;
+                snprintf(name, l, "%s.%ld.%u.tmp", filename, (long)getpid(), n);
+                int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+                if(fd >= 0) {
+                        if(st) {
+                                // only root can give files away, otherwise the new file keeps our owner
+                                int ignored = fchown(fd, st->st_uid, st->st_gid);
+                                (void) ignored;
+                                if(fchmod(fd, st->st_mode & 07777) != 0) {
+                                        close(fd);
+                                        remove(name);
+                                        die_perror("could not set the permissions of output file `%s`", filename);
+                                }
+                        }
+                        FILE *f = fdopen(fd, "wb");
+                        if(!f) { die_perror("could not open output file `%s`", name); }
+                        *temp_filename = name;
+                        return f;
+                }
+                if(errno != EEXIST) {
+                        die_perror("could not create output file `%s`", filename);
+                }
+        }
+}
+
+// whether filename is a symbolic link, which should keep pointing to the output
+static bool is_link(const char *filename) {
+        struct stat st;
+        return lstat(filename, &st) == 0 && S_ISLNK(st.st_mode);
+}
+
+// find where the output for filename goes, *target is the file a link points to, or NULL for filename itself
+// *exists is whether there already is a file there, then st is set to it
+// returns whether it must be written in place: for dangling links, special files like /dev/null or a pipe,
+// and files with several hard links, which should all keep seeing the output
+static bool resolve(const char *filename, char **target, struct stat *st, bool *exists) {
+        *target = NULL;
+        *exists = false;
+        if(is_link(filename)) {
+                *target = realpath(filename, NULL);
+                if(!*target) {
+                        return true;
+                }
+        }
+        *exists = stat(*target ? *target : filename, st) == 0;
+        return *exists && (!S_ISREG(st->st_mode) || st->st_nlink > 1);
+}
+
+// outputs still being written, so their temporary files can be removed when the program dies
+static struct output *open_outputs = NULL;
+
+static void remove_temp_files(void) {
+        OPENMP(critical(open_outputs))
+        for(struct output *o = open_outputs; o; o = o->next) {
+                remove(o->temp_filename);
+        }
+}
+
+static void add_open_output(struct output *output) {
+        static bool registered = false;
+        OPENMP(critical(open_outputs))
+        {
+                if(!registered && atexit(remove_temp_files) == 0) {
+                        registered = true;
+                }
+                output->next = open_outputs;
+                open_outputs = output;
+        }
+}
+
+static void remove_open_output(struct output *output) {
+        OPENMP(critical(open_outputs))
+        for(struct output **o = &open_outputs; *o; o = &(*o)->next) {
+                if(*o == output) {
+                        *o = output->next;
+                        break;
+                }
+        }
+}
+#endif
+
+// open output file for writing
+// regular files are written to a temporary file first, so a crash never leaves a partial output
+FILE *output_open(const char *filename, struct output *output) {
+        output->filename = filename;
+        output->target = NULL;
+        output->temp_filename = NULL;
+#ifdef _WIN32
+        output->f = fopen(filename, "wb");
+        if(!output->f) { die_perror("could not open output file `%s`", filename); }
+#else
+        // a link is kept, the file it points to is replaced
+        struct stat st;
+        bool exists;
+        if(resolve(filename, &output->target, &st, &exists)) {
+                free(output->target);
+                output->target = NULL;
+                output->f = fopen(filename, "wb");
+                if(!output->f) { die_perror("could not open output file `%s`", filename); }
+        } else {
+                const char *target = output->target ? output->target : filename;
+                output->f = open_temp(target, exists ? &st : NULL, &output->temp_filename);
+                add_open_output(output);
+        }
+#endif
+        output->buffer = malloc(output_buffer_size);
+        if(!output->buffer) { die("could not allocate output buffer"); }
+        if(setvbuf(output->f, output->buffer, _IOFBF, output_buffer_size) != 0) {
+                die("could not set output buffer");
+        }
+        return output->f;
+}
+
+// die now if filename could not be written by output_open, before any work is done for it
+// nothing is left behind, and an existing file is not changed
+void output_check(const char *filename) {
+#ifdef _WIN32
+        FILE *f = fopen(filename, "rb");
+        bool exists = f;
+        if(f) {
+                fclose(f);
+        }
+        f = fopen(filename, "ab");
+        if(!f) { die_perror("could not open output file `%s`", filename); }
+        fclose(f);
+        if(!exists) {
+                remove(filename);
+        }
+#else
+        char *target;
+        struct stat st;
+        bool exists;
+        if(resolve(filename, &target, &st, &exists)) {
+                // a dangling link can not be checked without creating the file it points to
+                if(exists && access(filename, W_OK) != 0) {
+                        die_perror("could not open output file `%s`", filename);
+                }
+        } else {
+                char *temp_filename;
+                FILE *f = open_temp(target ? target : filename, NULL, &temp_filename);
+                fclose(f);
+                remove(temp_filename);
+                free(temp_filename);
+        }
+        free(target);
+#endif
+}
+
+// finish writing output file, and move it into place
+void output_close(struct output *output) {
+        const char *name = output->temp_filename ? output->temp_filename : output->filename;
+        bool error = ferror(output->f);
+        if(fclose(output->f) != 0) {
+                error = true;
+        }
+        free(output->buffer);
+#ifndef _WIN32
+        if(output->temp_filename) {
+                remove_open_output(output);
+        }
+#endif
+        if(error) {
+                if(output->temp_filename) {
+                        remove(output->temp_filename);
+                }
+                die_perror("could not write output file `%s`", name);
+        }
+        if(output->temp_filename) {
+                const char *target = output->target ? output->target : output->filename;
+                if(rename(output->temp_filename, target) != 0) {
+                        remove(output->temp_filename);
+                        die_perror("could not move `%s` to output file `%s`", output->temp_filename, target);
+                }
+                free(output->temp_filename);
+        }
+        free(output->target);
+        output->f = NULL;
+}
@@ -0,0 +1,24 @@
+#ifndef JPEG2PNG_OUTPUT_H
+#define JPEG2PNG_OUTPUT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// output file, written to a temporary file that replaces the target when done
+struct output {
+        FILE *f;
+        const char *filename;
+        // file a symbolic link points to, NULL when filename itself is replaced
+        char *target;
+        // NULL when writing directly to the target
+        char *temp_filename;
+        char *buffer;
+        // next output still being written
+        struct output *next;
+};
+
+FILE *output_open(const char *filename, struct output *output);
+void output_check(const char *filename);
+void output_close(struct output *output);
+
+#endif
@@ -1,9 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <png.h>
 
 #include "png.h"
 #include "utils.h"
+#include "jpeg.h"
+
+// key of the text chunk with the iterations that produced the output, per component
+// libpng takes the key as not const
+static char iterations_key[] = "jpeg2png iterations";
 
 // png error handler
 static noreturn void png_die(png_struct *png_ptr, const char *error_msg){
@@ -16,8 +22,56 @@ static float clamp(float x) {
         return CLAMP(x, 0., 255.);
 }
 
+// convert CMYK to RGB, with values in [0, 255]
+static void cmyk_to_rgb(float c, float m, float y, float k, bool inverted, float rgb[3]) {
+        if(!inverted) {
+                c = 255. - c;
+                m = 255. - m;
+                y = 255. - y;
+                k = 255. - k;
+        }
+        rgb[0] = clamp(c) * clamp(k) / 255.;
+        rgb[1] = clamp(m) * clamp(k) / 255.;
+        rgb[2] = clamp(y) * clamp(k) / 255.;
+}
+
+// convert one pixel to gray or RGB
+// returns the number of channels written
+static unsigned convert_pixel(struct jpeg *jpeg, unsigned x, unsigned y, float out[3]) {
+        float v[MAX_NCOMPONENT];
+        for(unsigned c = 0; c < jpeg->ncomponent; c++) {
+                struct coef *coef = &jpeg->coefs[c];
+                v[c] = *p(coef->fdata, x, y, coef->w, coef->h);
+        }
+        switch(jpeg->color) {
+        case COLOR_GRAY:
+                out[0] = clamp(v[0]);
+                return 1;
+        case COLOR_YCBCR:
+        case COLOR_YCCK:
+                // YCbCr -> RGB
+                out[0] = clamp(v[0] + 1.402 * v[2]);
+                out[1] = clamp(v[0] - 0.34414 * v[1] - 0.71414 * v[2]);
+                out[2] = clamp(v[0] + 1.772 * v[1]);
+                if(jpeg->color == COLOR_YCCK) {
+                        // the YCC part is the inverted CMY
+                        cmyk_to_rgb(255. - out[0], 255. - out[1], 255. - out[2], v[3], jpeg->inverted, out);
+                }
+                return 3;
+        case COLOR_CMYK:
+                cmyk_to_rgb(v[0], v[1], v[2], v[3], jpeg->inverted, out);
+                return 3;
+        }
+        ASSUME(false);
+        return 0;
+}
+
 // write image to PNG file
-void write_png(FILE *out, unsigned w, unsigned h, unsigned bits, struct coef *y, struct coef *cb, struct coef *cr) {
+// iterations are recorded for each component, so a run seeded with the output can continue, or NULL
+void write_png(FILE *out, unsigned bits, struct jpeg *jpeg, const unsigned iterations[]) {
+        unsigned w = jpeg->w;
+        unsigned h = jpeg->h;
+        unsigned channels = jpeg->color == COLOR_GRAY ? 1 : 3;
         // initialize png
         ASSUME(bits == 8 || bits == 16);
         png_struct *png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
@@ -27,38 +81,44 @@ void write_png(FILE *out, unsigned w, unsigned h, unsigned bits, struct coef *y,
         void *error = png_get_error_ptr(png_ptr);
         png_set_error_fn(png_ptr, error, png_die, NULL);
         png_init_io(png_ptr, out);
-        png_set_IHDR(png_ptr, info_ptr, w, h, bits, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+        png_set_IHDR(png_ptr, info_ptr, w, h, bits, channels == 1 ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+        char iterations_text[16 * MAX_NCOMPONENT];
+        if(iterations) {
+                int n = 0;
+                for(unsigned c = 0; c < jpeg->ncomponent; c++) {
+                        n += snprintf(iterations_text + n, sizeof(iterations_text) - n, c ? ",%u" : "%u", iterations[c]);
+                }
+                png_text text;
+                memset(&text, 0, sizeof(text));
+                text.compression = PNG_TEXT_COMPRESSION_NONE;
+                text.key = iterations_key;
+                text.text = iterations_text;
+                png_set_text(png_ptr, info_ptr, &text, 1);
+        }
         png_write_info(png_ptr, info_ptr);
         unsigned depth = bits / 8;
-        png_byte *image_data = calloc(sizeof(png_byte), h * w * 3 * depth);
+        png_byte *image_data = calloc(sizeof(png_byte), h * w * channels * depth);
         if(!image_data) { die("could not allocate image data");}
 
         // write png lines
         for(unsigned i = 0; i < h; i++) {
                 for(unsigned j = 0; j < w; j++) {
-                        float yi = *p(y->fdata, j, i, y->w, y->h);
-                        float cbi = *p(cb->fdata, j, i, cb->w, cb->h);
-                        float cri = *p(cr->fdata, j, i, cr->w, cr->h);
-
-                        // YCbCr -> RGB
-                        float bitfactor = (1 << bits) / 256.;
-                        unsigned r = clamp(yi + 1.402 * cri) * bitfactor;
-                        unsigned g = clamp(yi - 0.34414 * cbi - 0.71414 * cri) * bitfactor;
-                        unsigned b = clamp(yi + 1.772 * cbi) * bitfactor;
+                        float rgb[3];
+                        unsigned n = convert_pixel(jpeg, j, i, rgb);
+                        ASSUME(n == channels);
+                        (void) n;
 
                         // write to png line
-                        png_byte *here = &image_data[(i*w+j)*3*depth];
-                        if(bits == 8) {
-                                here[0] = r & 0xFF;
-                                here[1] = g & 0xFF;
-                                here[2] = b & 0xFF;
-                        } else {
-                                here[0] = (r >> 8) & 0xFF;
-                                here[1] = r & 0xFF;
-                                here[2] = (g >> 8) & 0xFF;
-                                here[3] = g & 0xFF;
-                                here[4] = (b >> 8) & 0xFF;
-                                here[5] = b & 0xFF;
+                        float bitfactor = (1 << bits) / 256.;
+                        png_byte *here = &image_data[(i*w+j)*channels*depth];
+                        for(unsigned c = 0; c < channels; c++) {
+                                unsigned v = rgb[c] * bitfactor;
+                                if(bits == 8) {
+                                        here[c] = v & 0xFF;
+                                } else {
+                                        here[2*c] = (v >> 8) & 0xFF;
+                                        here[2*c+1] = v & 0xFF;
+                                }
                         }
                 }
         }
@@ -67,7 +127,7 @@ void write_png(FILE *out, unsigned w, unsigned h, unsigned bits, struct coef *y,
         png_byte **rows = malloc(sizeof(*rows) * h);
         if(!rows) { die("allocation failure"); }
         for(unsigned i = 0; i < h; i++) {
-                rows[i] = &image_data[i * w * 3 * depth];
+                rows[i] = &image_data[i * w * channels * depth];
         }
         // write
         png_write_image(png_ptr, rows);
@@ -76,3 +136,87 @@ void write_png(FILE *out, unsigned w, unsigned h, unsigned bits, struct coef *y,
         free(image_data);
         png_destroy_write_struct(&png_ptr, &info_ptr);
 }
+
+// read a PNG written by an earlier run as planes in the color space of the jpeg
+// the planes are w * h, at least the size of the jpeg, the edges are extended into the padding
+// iterations are set to the iterations recorded for each component, 0 when there are none
+void read_png(FILE *in, const char *filename, struct jpeg *jpeg, unsigned w, unsigned h, float *planes[], unsigned iterations[]) {
+        if(jpeg->color != COLOR_GRAY && jpeg->color != COLOR_YCBCR) {
+                die("`%s`: only grayscale and YCbCr pictures can be continued", filename);
+        }
+        unsigned channels = jpeg->color == COLOR_GRAY ? 1 : 3;
+        png_struct *png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        if(!png_ptr) { die("could not initialize PNG read struct"); }
+        png_info *info_ptr = png_create_info_struct(png_ptr);
+        if (!info_ptr) { die("could not initialize PNG info struct"); }
+        void *error = png_get_error_ptr(png_ptr);
+        png_set_error_fn(png_ptr, error, png_die, NULL);
+        png_init_io(png_ptr, in);
+        png_read_info(png_ptr, info_ptr);
+        for(unsigned c = 0; c < jpeg->ncomponent; c++) {
+                iterations[c] = 0;
+        }
+        png_text *texts;
+        int ntext = png_get_text(png_ptr, info_ptr, &texts, NULL);
+        for(int i = 0; i < ntext; i++) {
+                if(strcmp(texts[i].key, iterations_key) == 0) {
+                        int n = sscanf(texts[i].text, "%u,%u,%u,%u", &iterations[0], &iterations[1], &iterations[2], &iterations[3]);
+                        if(n != (int)jpeg->ncomponent) {
+                                die("`%s` has invalid iterations", filename);
+                        }
+                }
+        }
+        if(png_get_image_width(png_ptr, info_ptr) != jpeg->w || png_get_image_height(png_ptr, info_ptr) != jpeg->h) {
+                die("`%s` has a different size than the jpeg", filename);
+        }
+        // get 8 or 16 bit gray or RGB without alpha
+        png_set_expand(png_ptr);
+        png_set_strip_alpha(png_ptr);
+        unsigned color_type = png_get_color_type(png_ptr, info_ptr);
+        bool gray = !(color_type & PNG_COLOR_MASK_COLOR);
+        if(channels == 1 && !gray) {
+                png_set_rgb_to_gray(png_ptr, 1, -1, -1);
+        } else if(channels == 3 && gray) {
+                png_set_gray_to_rgb(png_ptr);
+        }
+        png_read_update_info(png_ptr, info_ptr);
+        unsigned bits = png_get_bit_depth(png_ptr, info_ptr);
+        ASSUME(bits == 8 || bits == 16);
+        unsigned depth = bits / 8;
+        size_t stride = png_get_rowbytes(png_ptr, info_ptr);
+        png_byte *image_data = malloc(stride * jpeg->h);
+        png_byte **rows = malloc(sizeof(*rows) * jpeg->h);
+        if(!image_data || !rows) { die("could not allocate image data"); }
+        for(unsigned i = 0; i < jpeg->h; i++) {
+                rows[i] = &image_data[i * stride];
+        }
+        png_read_image(png_ptr, rows);
+        png_read_end(png_ptr, NULL);
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        free(rows);
+
+        for(unsigned c = 0; c < channels; c++) {
+                planes[c] = alloc_real(w * h);
+        }
+        // values were truncated when written, so take the middle of their interval
+        float bitfactor = (1 << bits) / 256.;
+        for(unsigned y = 0; y < h; y++) {
+                for(unsigned x = 0; x < w; x++) {
+                        png_byte *here = &image_data[MIN(y, jpeg->h - 1) * stride + MIN(x, jpeg->w - 1) * channels * depth];
+                        float v[3];
+                        for(unsigned c = 0; c < channels; c++) {
+                                unsigned n = bits == 8 ? here[c] : here[2*c] << 8 | here[2*c+1];
+                                v[c] = (n + 0.5) / bitfactor;
+                        }
+                        if(channels == 1) {
+                                planes[0][y * w + x] = v[0] - 128.;
+                        } else {
+                                // RGB -> YCbCr
+                                planes[0][y * w + x] = 0.299 * v[0] + 0.587 * v[1] + 0.114 * v[2] - 128.;
+                                planes[1][y * w + x] = -0.168736 * v[0] - 0.331264 * v[1] + 0.5 * v[2];
+                                planes[2][y * w + x] = 0.5 * v[0] - 0.418688 * v[1] - 0.081312 * v[2];
+                        }
+                }
+        }
+        free(image_data);
+}
@@ -2,8 +2,9 @@
 #define JPEG2PNG_PNG_H
 
 #include <stdio.h>
-#include "jpeg2png.h"
+#include "jpeg.h"
 
-void write_png(FILE *out, unsigned w, unsigned h, unsigned bits, struct coef *y, struct coef *cb, struct coef *cr);
+void write_png(FILE *out, unsigned bits, struct jpeg *jpeg, const unsigned iterations[]);
+void read_png(FILE *in, const char *filename, struct jpeg *jpeg, unsigned w, unsigned h, float *planes[], unsigned iterations[]);
 
 #endif
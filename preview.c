@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "preview.h"
+#include "png.h"
+#include "output.h"
+#include "utils.h"
+
+// the largest width or height of a preview, larger pictures are scaled down by an integer factor
+static const unsigned preview_size = 512;
+
+// whether a preview is written after the given number of iterations
+bool preview_wanted(struct preview *preview, unsigned iteration) {
+        for(unsigned i = 0; i < preview->niteration; i++) {
+                if(preview->iterations[i] == iteration) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+// scale down the current planes and write them as PNG, replacing the previous preview
+// coefs has the planes in fdata, with the subsampling of each plane relative to the picture
+void preview_write(struct preview *preview, unsigned nchannel, struct coef coefs[nchannel]) {
+        struct jpeg *jpeg = preview->jpeg;
+        unsigned f = MAX((MAX(jpeg->w, jpeg->h) + preview_size - 1) / preview_size, 1);
+        unsigned w = (jpeg->w + f - 1) / f;
+        unsigned h = (jpeg->h + f - 1) / f;
+        struct jpeg small = *jpeg;
+        small.w = w;
+        small.h = h;
+        for(unsigned c = 0; c < nchannel; c++) {
+                struct coef *coef = &coefs[c];
+                struct coef *out = &small.coefs[c];
+                out->w = w;
+                out->h = h;
+                out->w_samp = 1;
+                out->h_samp = 1;
+                out->data = NULL;
+                out->fdata = alloc_real(w * h);
+                bool chroma = (jpeg->color == COLOR_YCBCR || jpeg->color == COLOR_YCCK) && (c == 1 || c == 2);
+                // box filter over the picture pixels, clipped at the edges
+                for(unsigned y = 0; y < h; y++) {
+                        for(unsigned x = 0; x < w; x++) {
+                                float sum = 0.;
+                                unsigned n = 0;
+                                for(unsigned sy = y * f; sy < MIN((y + 1) * f, jpeg->h); sy++) {
+                                        for(unsigned sx = x * f; sx < MIN((x + 1) * f, jpeg->w); sx++) {
+                                                unsigned cx = MIN(sx / coef->w_samp, coef->w - 1);
+                                                unsigned cy = MIN(sy / coef->h_samp, coef->h - 1);
+                                                sum += *p(coef->fdata, cx, cy, coef->w, coef->h);
+                                                n++;
+                                        }
+                                }
+                                *p(out->fdata, x, y, w, h) = sum / n + (chroma ? 0. : 128.);
+                        }
+                }
+        }
+        struct output output;
+        write_png(output_open(preview->filename, &output), 8, &small, NULL);
+        output_close(&output);
+        for(unsigned c = 0; c < nchannel; c++) {
+                free_real(small.coefs[c].fdata);
+        }
+}
+
+// remove the preview once the result is written
+void preview_remove(struct preview *preview) {
+        if(remove(preview->filename) != 0 && errno != ENOENT) {
+                die_perror("could not remove preview `%s`", preview->filename);
+        }
+}
@@ -0,0 +1,22 @@
+#ifndef JPEG2PNG_PREVIEW_H
+#define JPEG2PNG_PREVIEW_H
+
+#include <stdbool.h>
+#include "jpeg2png.h"
+#include "jpeg.h"
+
+// small 8 bit pictures of the intermediate result, written during the optimization
+struct preview {
+        char *filename;
+        // the iterations after which to write a preview
+        const unsigned *iterations;
+        unsigned niteration;
+        // for the size and color space
+        struct jpeg *jpeg;
+};
+
+bool preview_wanted(struct preview *preview, unsigned iteration);
+void preview_write(struct preview *preview, unsigned nchannel, struct coef coefs[nchannel]);
+void preview_remove(struct preview *preview);
+
+#endif
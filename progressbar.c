@@ -5,17 +5,23 @@
 
 static const unsigned progressbar_width = 70;
 
-static unsigned get_to_print(unsigned current, unsigned max) {
+static unsigned get_to_print(unsigned long long current, unsigned long long max) {
         return progressbar_width * current / max;
 }
 
-static unsigned get_percentage(unsigned current, unsigned max) {
+static unsigned get_percentage(unsigned long long current, unsigned long long max) {
         return 100 * current / max;
 }
 
+// the shown value, more than the maximum is shown as the maximum
+static unsigned long long get_shown(unsigned long long current, unsigned long long max) {
+        return current > max ? max : current;
+}
+
 static void progressbar_show(struct progressbar *pb) {
-        unsigned to_print = get_to_print(pb->current, pb->max);
-        unsigned percentage = get_percentage(pb->current, pb->max);
+        unsigned long long shown = get_shown(pb->current, pb->max);
+        unsigned to_print = get_to_print(shown, pb->max);
+        unsigned percentage = get_percentage(shown, pb->max);
 
         printf("\r[");
         for(unsigned i = 0; i < to_print; i++) {
@@ -28,17 +34,19 @@ static void progressbar_show(struct progressbar *pb) {
         fflush(stdout);
 }
 
-void progressbar_start(struct progressbar *pb, unsigned max) {
+void progressbar_start(struct progressbar *pb, unsigned long long max) {
         pb->max = max;
         pb->current = 0;
         progressbar_show(pb);
 }
 
-void progressbar_set(struct progressbar *pb, unsigned current) {
-        unsigned old_to_print = get_to_print(pb->current, pb->max);
-        unsigned old_percentage = get_percentage(pb->current, pb->max);
-        unsigned to_print = get_to_print(current, pb->max);
-        unsigned percentage = get_percentage(current, pb->max);
+void progressbar_set(struct progressbar *pb, unsigned long long current) {
+        unsigned long long old_shown = get_shown(pb->current, pb->max);
+        unsigned long long shown = get_shown(current, pb->max);
+        unsigned old_to_print = get_to_print(old_shown, pb->max);
+        unsigned old_percentage = get_percentage(old_shown, pb->max);
+        unsigned to_print = get_to_print(shown, pb->max);
+        unsigned percentage = get_percentage(shown, pb->max);
         pb->current = current;
         if(old_to_print == to_print && old_percentage == percentage) {
                 return;
@@ -46,7 +54,7 @@ void progressbar_set(struct progressbar *pb, unsigned current) {
         progressbar_show(pb);
 }
 
-void progressbar_add(struct progressbar *pb, unsigned n) {
+void progressbar_add(struct progressbar *pb, unsigned long long n) {
         progressbar_set(pb, pb->current + n);
 }
 
@@ -2,16 +2,17 @@
 #define JPEG2PNG_PROGRESSBAR_H
 
 struct progressbar {
-        unsigned current;
-        unsigned max;
+        // can be more than max, it is then shown as max
+        unsigned long long current;
+        unsigned long long max;
 };
 
 // initialize progressbar with maximum value
-void progressbar_start(struct progressbar *pb, unsigned max);
+void progressbar_start(struct progressbar *pb, unsigned long long max);
 // set current value
-void progressbar_set(struct progressbar *pb, unsigned current);
+void progressbar_set(struct progressbar *pb, unsigned long long current);
 // add to current value
-void progressbar_add(struct progressbar *pb, unsigned n);
+void progressbar_add(struct progressbar *pb, unsigned long long n);
 // add one to current value
 void progressbar_inc(struct progressbar *pb);
 // clear line of progress bar
@@ -0,0 +1,68 @@
+#include "resample.h"
+#include "utils.h"
+
+// interpolate linearly between the centers of the input samples, like libjpeg's fancy upsampling
+// out[x] depends on in at (x + 0.5) / samp - 0.5, clamped to the image
+static void upsample_line(float *in, unsigned in_stride, unsigned n, unsigned samp, float *out, unsigned out_stride, unsigned out_n) {
+        for(unsigned x = 0; x < out_n; x++) {
+                float pos = (x + 0.5f) / samp - 0.5f;
+                pos = CLAMP(pos, 0.f, (float)(n - 1));
+                unsigned i0 = pos;
+                unsigned i1 = MIN(i0 + 1, n - 1);
+                float f = pos - i0;
+                out[x * out_stride] = (1.f - f) * in[i0 * in_stride] + f * in[i1 * in_stride];
+        }
+}
+
+// upsample image by integer factors to out_w x out_h
+// returns a new buffer, the input is not freed
+float *upsample(float *in, unsigned w, unsigned h, unsigned w_samp, unsigned h_samp, unsigned out_w, unsigned out_h) {
+        ASSUME(out_w <= w * w_samp);
+        ASSUME(out_h <= h * h_samp);
+        // horizontal
+        float *temp = alloc_real(out_w * h);
+        for(unsigned y = 0; y < h; y++) {
+                upsample_line(&in[y * w], 1, w, w_samp, &temp[y * out_w], 1, out_w);
+        }
+        // vertical
+        float *out = alloc_real(out_w * out_h);
+        for(unsigned x = 0; x < out_w; x++) {
+                upsample_line(&temp[x], out_w, h, h_samp, &out[x], out_w, out_h);
+        }
+        free_real(temp);
+        return out;
+}
+
+// average the input samples that each output sample covers, weighted by the covered fraction
+static void downscale_line(const float *in, unsigned in_stride, unsigned n, float *out, unsigned out_stride, unsigned out_n) {
+        float scale = (float)n / out_n;
+        for(unsigned x = 0; x < out_n; x++) {
+                float start = x * scale;
+                float end = MIN((x + 1) * scale, (float)n);
+                float sum = 0.f;
+                for(unsigned i = start; i < end; i++) {
+                        float covered = MIN(i + 1.f, end) - MAX((float)i, start);
+                        sum += covered * in[i * in_stride];
+                }
+                out[x * out_stride] = sum / (end - start);
+        }
+}
+
+// scale the top left w x h of an image of width stride down to out_w x out_h by area averaging
+// returns a new buffer, the input is not freed
+float *downscale(const float *in, unsigned stride, unsigned w, unsigned h, unsigned out_w, unsigned out_h) {
+        ASSUME(out_w <= w);
+        ASSUME(out_h <= h);
+        // horizontal
+        float *temp = alloc_real(out_w * h);
+        for(unsigned y = 0; y < h; y++) {
+                downscale_line(&in[y * stride], 1, w, &temp[y * out_w], 1, out_w);
+        }
+        // vertical
+        float *out = alloc_real(out_w * out_h);
+        for(unsigned x = 0; x < out_w; x++) {
+                downscale_line(&temp[x], out_w, h, &out[x], out_w, out_h);
+        }
+        free_real(temp);
+        return out;
+}
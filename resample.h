@@ -0,0 +1,7 @@
+#ifndef JPEG2PNG_RESAMPLE_H
+#define JPEG2PNG_RESAMPLE_H
+
+float *upsample(float *in, unsigned w, unsigned h, unsigned w_samp, unsigned h_samp, unsigned out_w, unsigned out_h);
+float *downscale(const float *in, unsigned stride, unsigned w, unsigned h, unsigned out_w, unsigned out_h);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef JPEG2PNG_SHA256_H
+#define JPEG2PNG_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct sha256 {
+        uint32_t state[8];
+        uint64_t length;
+        unsigned char buffer[64];
+        unsigned nbuffer;
+};
+
+void sha256_start(struct sha256 *s);
+void sha256_update(struct sha256 *s, const void *data, size_t n);
+void sha256_finish(struct sha256 *s, unsigned char digest[32]);
+
+#endif
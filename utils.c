@@ -1,3 +1,8 @@
+#ifdef USE_HUGE_PAGES
+  #define _DEFAULT_SOURCE
+  #include <stdint.h>
+  #include <sys/mman.h>
+#endif
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -16,6 +21,31 @@ void die_message_start() {
         fprintf(stderr, "jpeg2png: ");
 }
 
+#ifdef USE_HUGE_PAGES
+// size of a transparent huge page on x86-64
+static const size_t huge_page = 2 << 20;
+
+// allocate a buffer aligned for simd
+// buffers spanning huge pages, the planes, are marked for transparent huge pages,
+// so streaming through them needs far fewer TLB entries
+// the buffers are deliberately not aligned to huge pages, planes all starting at the same offset in physically
+// contiguous pages would compete for the same cache sets
+// the pages are still placed by the first thread to touch them
+void *alloc_huge(size_t size) {
+        void *f = aligned_alloc(16, size);
+#ifdef MADV_HUGEPAGE
+        if(f && size >= 2 * huge_page) {
+                // only a hint, without support the planes keep normal pages
+                uintptr_t page = 4096;
+                uintptr_t start = ((uintptr_t)f + page - 1) & ~(page - 1);
+                uintptr_t end = ((uintptr_t)f + size) & ~(page - 1);
+                madvise((void *)start, end - start, MADV_HUGEPAGE);
+        }
+#endif
+        return f;
+}
+#endif
+
 // abort program with a message
 noreturn void die(const char *msg, ...)  {
         die_message_start();
@@ -66,3 +96,10 @@ void compare(const char * name, unsigned w, unsigned h, float *new, float *old)
                 }
         }
 }
+
+// external definitions of the inline functions of utils.h, for calls the compiler does not inline, as in debug builds
+extern inline void check(unsigned x, unsigned y, unsigned w, unsigned h);
+extern inline float *p(float *in, unsigned x, unsigned y, unsigned w, unsigned h);
+extern inline float sqr(float x);
+extern inline float *alloc_real(size_t n);
+extern inline void free_real(float *p);
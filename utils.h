@@ -52,6 +52,14 @@ void compare(const char *name, unsigned w, unsigned h, float *new, float *old);
   #define POSSIBLY_UNUSED
 #endif
 
+// force inlining of functions whose arguments are constant in the caller, so it is specialized
+// without the attribute these are ordinary functions, inlined only where the compiler chooses
+#ifdef ATTRIBUTE_ALWAYS_INLINE
+  #define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+  #define ALWAYS_INLINE
+#endif
+
 // nicer OpenMP pragmas
 #define STRINGIFY(x) #x
 #ifdef _OPENMP
@@ -85,10 +93,18 @@ inline float sqr(float x) {
         return x * x;
 }
 
+#ifdef USE_HUGE_PAGES
+void *alloc_huge(size_t size);
+#endif
+
 // allocate aligned buffer for simd
+// the size is rounded up to a multiple of the alignment, as aligned_alloc requires
 inline float *alloc_real(size_t n) {
+        n = (n + 3) / 4 * 4;
 #if defined(_WIN32)
         float *f = _aligned_malloc(n * sizeof(float), 16);
+#elif defined(USE_HUGE_PAGES)
+        float *f = alloc_huge(n * sizeof(float));
 #else
         float *f = aligned_alloc(16, n * sizeof(float));
 #endif